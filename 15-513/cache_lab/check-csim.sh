@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# check-csim.sh:regression suite of csim
+#
+# run csim (./csim,or the binary given) over every line of
+# traces/expected and compare its summary with the one recorded there;
+# each trace is also converted with -c and simulated from the binary
+# form,and the -m row of the same s and E must give the same counts
+#
+#   usage: ./check-csim.sh [csim]
+#
+
+csim=${1:-./csim}
+dir=$(dirname "$0")/traces
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+total=0
+
+check(){
+    if [ "$2" != "$3" ]; then
+        echo "FAIL $1: got '$2' expected '$3'"
+        fail=$((fail+1))
+    fi
+}
+
+while read -r s E b trace expect; do
+    case $s in
+    '#'*|'') continue ;;
+    esac
+    t=$dir/$trace
+    bin=$tmp/$trace.bin
+    [ -f "$bin" ] || "$csim" -c "$bin" -t "$t" || { echo "FAIL $trace:-c"; fail=$((fail+1)); }
+    total=$((total+1))
+    check "-s $s -E $E -b $b $trace" \
+          "$("$csim" -s "$s" -E "$E" -b "$b" -t "$t")" "$expect"
+    check "-s $s -E $E -b $b $trace (binary)" \
+          "$("$csim" -s "$s" -E "$E" -b "$b" -t "$bin")" "$expect"
+    check "-m -s $s -E $E -b $b $trace" \
+          "$("$csim" -m -s "$s" -E "$E" -b "$b" -t "$t" | awk -v s="$s" -v E="$E" \
+              '$1==s&&$2==E{printf "hits:%s misses:%s evictions:%s",$3,$4,$5}')" \
+          "$expect"
+done < "$dir/expected"
+
+if [ "$fail" -ne 0 ]; then
+    echo "$fail of $((total*3)) checks failed"
+    exit 1
+fi
+echo "all $((total*3)) checks passed"
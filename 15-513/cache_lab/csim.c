@@ -10,26 +10,67 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cachelab.h"
+#if defined(__x86_64__)||defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 //declartion of 64-bit address type
 typedef unsigned long long int addr_type;
 
-//the contents of cache lines(based on recitation ppt)
+#define TRACE_BATCH 4096     //records decoded per trace_next call
+#define TRACE_BUF (1<<20)    //read buffer for pipes and the end of a map
+#define TRACE_PAD 64         //zero bytes kept behind the data in the buffer
+#define TRACE_MAXREC 21      //longest binary record:op and two varints
+
+//first bytes of a binary trace,see trace_convert
+const char trace_magic[8]={'C','S','I','M','T','R','C','1'};
+
+//one decoded trace record
+typedef struct{
+    addr_type address;
+    int size;
+    char op;             //I,L,S or M
+}trace_rec;
+
+//trace reader:a regular file is mapped and parsed in place,a pipe
+//or stdin goes through buf;records are only parsed up to limit,
+//where the last complete one ends,so the parser never checks for
+//the end of the data in the middle of a record
+typedef struct{
+    int fd;
+    bool binary;         //compact binary trace,see trace_convert
+    bool mapped;         //p still points into the mapping
+    bool eof;            //nothing more to read behind data_end
+    bool done;           //every record has been returned
+    char *map;
+    size_t map_len;
+    char *buf;
+    char *p;             //next record
+    char *limit;
+    char *data_end;
+    addr_type last;      //previous address,binary traces store deltas
+    unsigned long long bytes;   //input read so far,for the report
+}trace_reader;
+
+//value of a hex digit,-1 for any other character
+signed char hex_value[256];
+
+//cache of S sets,E lines per set,in one contiguous allocation
+//line i of set k is entry k*E+i of each array;
+//lines are filled in order and never invalidated,so the valid
+//lines of a set are always lines 0..fill-1
 typedef struct{
-    int valid;        //valid bit
-    int LRU;          //Least Recently Used
-    int tag;          //tag bits
-}cache_line;
-
-//set is 1D array of cache lines
-typedef struct{  
-    cache_line *cacheLines;  
-}cache_set; 
-
-//cache is 2D array of cache lines
-typedef struct{  
-    cache_set *cacheSets; 
+    addr_type *tags;              //tag bits of every line
+    unsigned long long *stamps;   //time of last use of every line
+    int *fill;                    //valid lines per set
+    unsigned long long clock;     //accesses so far
 }cache;
 
 //simply count cache hits,misses,evictions
@@ -40,37 +81,130 @@ int hits,misses,evictions;
 //block offsets are not used;
 cache init_cache(int s,int E,int b){
 
-    int i,j;
     cache my_cache;  
-    
-    my_cache.cacheSets=(cache_set*)malloc(sizeof(cache_set)*s);
-    
-    for (i=0;i<s;i++){
-        my_cache.cacheSets[i].cacheLines=(cache_line*)malloc(sizeof(cache_line)*E);        
-        for (j=0;j<E;j++){
-            my_cache.cacheSets[i].cacheLines[j].valid=0;
-            my_cache.cacheSets[i].cacheLines[j].LRU=0;
-            my_cache.cacheSets[i].cacheLines[j].tag=0;    
-        }
+
+    (void)b;
+    my_cache.tags=(addr_type*)malloc(sizeof(addr_type)*s*E);
+    my_cache.stamps=(unsigned long long*)malloc(sizeof(unsigned long long)*s*E);
+    my_cache.fill=(int*)calloc(s,sizeof(int));
+    my_cache.clock=0;
+    if (my_cache.tags==NULL||my_cache.stamps==NULL||my_cache.fill==NULL){
+        printf("Error:cache too large\n");
+        exit(1);
     }
     return my_cache;
 }
 
-//to find the evition line,LRU replacement policy.
-int find_LRU_line(cache_set my_cache_set,int E){
+//to find the evition line,LRU replacement policy:
+//the line with the oldest stamp of a full set
+int find_LRU_line(unsigned long long *stamps,int E){
+
+    int i;
+    int min_LRU_index=0;
+
+    for(i=1;i<E;i++){
+        if(stamps[i]<stamps[min_LRU_index]){
+            min_LRU_index=i;
+        }
+    }
+    return min_LRU_index;
+}
+
+//tag matchers:return the line among the n valid lines of a set
+//that holds tag,or -1;tags of valid lines are distinct,so the
+//first match is the only one
+int find_tag_scalar(const addr_type *tags,int n,addr_type tag){
 
     int i;
-    int max_LRU_index=0;
-    int max_LRU=my_cache_set.cacheLines[0].LRU;
 
-    //compare a[0] to other elements
-    for(i=0;i<E;i++){
-        if(my_cache_set.cacheLines[i].LRU>max_LRU){
-            max_LRU_index=i;
-            max_LRU=my_cache_set.cacheLines[i].LRU;
+    for (i=0;i<n;i++){
+        if (tags[i]==tag){
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+//2 ways per compare,movemask gives one bit per way
+__attribute__((target("sse4.1")))
+int find_tag_sse41(const addr_type *tags,int n,addr_type tag){
+
+    int i,mask;
+    __m128i key=_mm_set1_epi64x((long long)tag);
+
+    for (i=0;i+2<=n;i+=2){
+        mask=_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(
+            _mm_loadu_si128((const __m128i*)(tags+i)),key)));
+        if (mask){
+            return i+__builtin_ctz(mask);
         }
     }
-    return max_LRU_index;
+    if (i<n&&tags[i]==tag){
+        return i;
+    }
+    return -1;
+}
+
+//4 ways per compare,8 per loop with the two masks merged
+__attribute__((target("avx2")))
+int find_tag_avx2(const addr_type *tags,int n,addr_type tag){
+
+    int i,mask;
+    __m256i key=_mm256_set1_epi64x((long long)tag);
+
+    for (i=0;i+8<=n;i+=8){
+        mask=_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(
+                _mm256_loadu_si256((const __m256i*)(tags+i)),key)))
+            |_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(
+                _mm256_loadu_si256((const __m256i*)(tags+i+4)),key)))<<4;
+        if (mask){
+            return i+__builtin_ctz(mask);
+        }
+    }
+    for (;i+4<=n;i+=4){
+        mask=_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(
+            _mm256_loadu_si256((const __m256i*)(tags+i)),key)));
+        if (mask){
+            return i+__builtin_ctz(mask);
+        }
+    }
+    for (;i<n;i++){
+        if (tags[i]==tag){
+            return i;
+        }
+    }
+    return -1;
+}
+#endif
+
+//matcher used by run_cache,set by pick_matcher
+int (*find_tag)(const addr_type *tags,int n,addr_type tag)=find_tag_scalar;
+
+//matchers this cpu can run,best last
+typedef struct{
+    const char *name;
+    int (*match)(const addr_type *tags,int n,addr_type tag);
+}matcher;
+
+matcher matchers[3];
+int n_matchers;
+
+//runtime cpu dispatch:list the usable matchers and pick the best
+void pick_matcher(void){
+
+    n_matchers=0;
+    matchers[n_matchers++]=(matcher){"scalar",find_tag_scalar};
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")){
+        matchers[n_matchers++]=(matcher){"sse4.1",find_tag_sse41};
+    }
+    if (__builtin_cpu_supports("avx2")){
+        matchers[n_matchers++]=(matcher){"avx2",find_tag_avx2};
+    }
+#endif
+    find_tag=matchers[n_matchers-1].match;
 }
 
 //return the tag bits of input address
@@ -89,92 +223,674 @@ addr_type find_cache_set(addr_type address,int s,int b){
 }
 
 //to simulatate the behavior of caches
-void run_cache(cache my_cache,addr_type address,int s,int E,int b) {
+//one pass of find_tag over the tags of the set,a hit only
+//refreshes its stamp;the first invalid line is simply line fill
+void run_cache(cache *my_cache,addr_type address,int s,int E,int b) {
 
-	int i,j;
-    bool missed=true;        //status:cache miss=true    
-    bool evicted=true; 
+    int i;
     int evict_index;         //if eviction is needed,find the evicted line
     addr_type set;
     addr_type addr_tag;
+    addr_type *tags;
+    unsigned long long *stamps;
+    int fill;
 
     set=find_cache_set(address,s,b);
     addr_tag=find_addr_tag(address,s,b);
-	
+    tags=my_cache->tags+set*E;
+    stamps=my_cache->stamps+set*E;
+    fill=my_cache->fill[set];
+    my_cache->clock+=1;
+
     //if cache hit
-    for (i=0;i<E;i++){
-        my_cache.cacheSets[set].cacheLines[i].LRU+=1;
-        if(my_cache.cacheSets[set].cacheLines[i].valid==1){
-            if (my_cache.cacheSets[set].cacheLines[i].tag==addr_tag){
-                hits++;
-                //if cache hit,missed=false
-                missed=false;
-                my_cache.cacheSets[set].cacheLines[i].LRU=0;
+    if ((i=find_tag(tags,fill,addr_tag))>=0){
+        hits++;
+        stamps[i]=my_cache->clock;
+        return;
+    }
+
+    //if cache miss:fill the next empty line
+    misses+=1;
+    if (fill<E){
+        tags[fill]=addr_tag;
+        stamps[fill]=my_cache->clock;
+        my_cache->fill[set]=fill+1;
+        return;
+    }
+
+    //if missed and the set is full:eviction is needed
+    //LRU replacement policy to find victim line
+    evictions+=1;
+    evict_index=find_LRU_line(stamps,E);
+    tags[evict_index]=addr_tag;
+    stamps[evict_index]=my_cache->clock;
+    return;
+}
+
+//free malloc space in case segmentation fault
+void free_cache(cache my_cache){
+
+    free(my_cache.tags);
+    free(my_cache.stamps);
+    free(my_cache.fill);
+    return;
+}
+
+//read up to len bytes into dst,fewer only at the end of the input
+size_t trace_read(trace_reader *t,char *dst,size_t len){
+
+    size_t got=0;
+    ssize_t n;
+
+    while (got<len&&!t->eof){
+        n=read(t->fd,dst+got,len-got);
+        if (n<0){
+            printf("Error:cannot read trace\n");
+            exit(1);
+        }
+        if (n==0){
+            t->eof=true;
+        }
+        got+=n;
+    }
+    t->bytes+=got;
+    return got;
+}
+
+//set limit behind the last complete record between p and data_end
+void trace_limit(trace_reader *t){
+
+    char *q;
+
+    if (!t->mapped&&t->eof){
+        //everything is in buf,followed by TRACE_PAD zero bytes
+        t->limit=t->data_end;
+        if (!t->binary&&t->data_end>t->p&&t->data_end[-1]!='\n'){
+            *t->data_end='\n';   //end the last line
+            t->limit+=1;
+        }
+    }else if (t->binary){
+        t->limit=t->data_end-t->p>TRACE_MAXREC?t->data_end-TRACE_MAXREC:t->p;
+    }else{
+        for (q=t->data_end;q>t->p&&q[-1]!='\n';q--){
+        }
+        t->limit=q;
+    }
+}
+
+//move the unparsed rest of the data to the front of buf and read
+//more behind it;a line longer than the whole buffer is dropped
+void trace_fill(trace_reader *t){
+
+    size_t left=t->data_end-t->p;
+
+    if (left>=TRACE_BUF){
+        left=0;
+    }
+    memmove(t->buf,t->p,left);
+    t->mapped=false;
+    t->p=t->buf;
+    t->data_end=t->buf+left;
+    t->data_end+=trace_read(t,t->data_end,TRACE_BUF-left);
+    memset(t->data_end,0,TRACE_PAD);
+    trace_limit(t);
+}
+
+//open file (stdin for null or "-") and tell text from binary traces
+void trace_open(trace_reader *t,const char *file){
+
+    int i;
+    struct stat st;
+
+    memset(t,0,sizeof(*t));
+    for (i=0;i<256;i++){
+        hex_value[i]=-1;
+    }
+    for (i=0;i<10;i++){
+        hex_value['0'+i]=i;
+    }
+    for (i=0;i<6;i++){
+        hex_value['a'+i]=hex_value['A'+i]=10+i;
+    }
+
+    t->buf=(char*)malloc(TRACE_BUF+TRACE_PAD);
+    if (t->buf==NULL){
+        printf("Error:no memory for the trace buffer\n");
+        exit(1);
+    }
+    if (file==NULL||strcmp(file,"-")==0){
+        t->fd=STDIN_FILENO;
+    }else if ((t->fd=open(file,O_RDONLY))<0){
+        printf("Error:cannot open %s\n",file);
+        exit(1);
+    }
+
+    if (fstat(t->fd,&st)==0&&S_ISREG(st.st_mode)&&st.st_size>0){
+        t->map=(char*)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,t->fd,0);
+        if (t->map==MAP_FAILED){
+            t->map=NULL;
+        }
+    }
+    if (t->map){
+        madvise(t->map,st.st_size,MADV_SEQUENTIAL);
+        t->map_len=st.st_size;
+        t->mapped=true;
+        t->eof=true;
+        t->bytes=t->map_len;
+        t->p=t->map;
+        t->data_end=t->map+t->map_len;
+    }else{
+        t->p=t->buf;
+        t->data_end=t->buf+trace_read(t,t->buf,sizeof(trace_magic));
+    }
+    if (t->data_end-t->p>=(long)sizeof(trace_magic)
+            &&memcmp(t->p,trace_magic,sizeof(trace_magic))==0){
+        t->binary=true;
+        t->p+=sizeof(trace_magic);
+    }
+    if (t->mapped){
+        trace_limit(t);
+    }else{
+        trace_fill(t);
+    }
+}
+
+void trace_close(trace_reader *t){
+
+    if (t->map){
+        munmap(t->map,t->map_len);
+    }
+    if (t->fd!=STDIN_FILENO){
+        close(t->fd);
+    }
+    free(t->buf);
+}
+
+//parse the text line at p:" L 7ff000398,8" or "I 0400d7d4,8";
+//the line ends with a newline before limit,so the loops stop on it
+//without a bounds check;return false for a blank line
+bool trace_parse_text(trace_reader *t,trace_rec *rec){
+
+    char *p=t->p;
+    addr_type address=0;
+    int size=0;
+    int digit;
+
+    while (*p==' '||*p=='\t'){
+        p++;
+    }
+    if (*p=='\n'){
+        t->p=p+1;
+        return false;
+    }
+    rec->op=*p++;
+    while (*p==' '){
+        p++;
+    }
+    while ((digit=hex_value[(unsigned char)*p])>=0){
+        address=address<<4|digit;
+        p++;
+    }
+    if (*p==','){
+        p++;
+        while ((unsigned)(*p-'0')<10){
+            size=size*10+(*p-'0');
+            p++;
+        }
+    }
+    while (*p!='\n'){
+        p++;
+    }
+    t->p=p+1;
+    rec->address=address;
+    rec->size=size;
+    return true;
+}
+
+//read a 7-bit varint,low groups first
+addr_type trace_varint(unsigned char **pp){
+
+    unsigned char *p=*pp;
+    addr_type value=0;
+    int shift=0;
+
+    do {
+        value|=(addr_type)(*p&0x7f)<<shift;
+        shift+=7;
+    } while ((*p++&0x80)&&shift<64);
+    *pp=p;
+    return value;
+}
+
+//parse the binary record at p;the zero padding behind the data
+//reads as op 0,the end of the trace
+bool trace_parse_binary(trace_reader *t,trace_rec *rec){
+
+    unsigned char *p=(unsigned char*)t->p;
+    addr_type delta;
+
+    rec->op=*p++;
+    if (rec->op==0){
+        t->done=true;
+        return false;
+    }
+    rec->size=(int)trace_varint(&p);
+    delta=trace_varint(&p);
+    t->last+=(delta>>1)^-(delta&1);    //zigzag
+    rec->address=t->last;
+    t->p=(char*)p;
+    return true;
+}
+
+//decode up to max records into recs,return how many;0 at the end
+int trace_next(trace_reader *t,trace_rec *recs,int max){
+
+    int n=0;
+
+    while (n<max&&!t->done){
+        if (t->p>=t->limit){
+            if (!t->mapped&&t->eof){
+                t->done=true;
+                break;
             }
+            trace_fill(t);
+            continue;
+        }
+        if (t->binary){
+            n+=trace_parse_binary(t,&recs[n]);
+        }else{
+            n+=trace_parse_text(t,&recs[n]);
         }
     }
-    
-    //if cache miss:possible cache evictions
-    if (missed==true){
-        misses+=1;
-        for(j=0;j<E;j++){
-            //valid=0:empty line
-            if(my_cache.cacheSets[set].cacheLines[j].valid==0){
-                my_cache.cacheSets[set].cacheLines[j].valid=1;
-                my_cache.cacheSets[set].cacheLines[j].LRU=0;
-                my_cache.cacheSets[set].cacheLines[j].tag=addr_tag;
-                //eviction is not needed 
-                evicted=false;
-                break;  
+    return n;
+}
+
+//write a 7-bit varint at p,return the byte behind it
+unsigned char *trace_put_varint(unsigned char *p,addr_type value){
+
+    while (value>=0x80){
+        *p++=(unsigned char)(value|0x80);
+        value>>=7;
+    }
+    *p++=(unsigned char)value;
+    return p;
+}
+
+//convert the trace of t into a compact binary trace in file:the
+//magic,then per record the op,the size and the zigzag-encoded
+//difference to the previous address,both as varints;about half
+//the size of the text and decoded without any parsing
+void trace_convert(trace_reader *t,const char *file){
+
+    static trace_rec recs[TRACE_BATCH];
+    static unsigned char out[TRACE_BATCH*TRACE_MAXREC];
+    unsigned char *q;
+    addr_type last=0;
+    long long delta;
+    int i,n;
+    FILE *fp=fopen(file,"wb");
+
+    if (fp==NULL){
+        printf("Error:cannot create %s\n",file);
+        exit(1);
+    }
+    fwrite(trace_magic,1,sizeof(trace_magic),fp);
+    while ((n=trace_next(t,recs,TRACE_BATCH))>0){
+        q=out;
+        for (i=0;i<n;i++){
+            delta=(long long)(recs[i].address-last);
+            last=recs[i].address;
+            *q++=(unsigned char)recs[i].op;
+            q=trace_put_varint(q,(addr_type)recs[i].size);
+            q=trace_put_varint(q,((addr_type)delta<<1)^(addr_type)(delta>>63));
+        }
+        fwrite(out,1,q-out,fp);
+    }
+    if (fclose(fp)!=0){
+        printf("Error:cannot write %s\n",file);
+        exit(1);
+    }
+}
+
+//parse the whole trace without simulating it,report the throughput
+void trace_report(trace_reader *t){
+
+    static trace_rec recs[TRACE_BATCH];
+    unsigned long long records=0;
+    struct timespec t0,t1;
+    double sec;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    while ((n=trace_next(t,recs,TRACE_BATCH))>0){
+        records+=n;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    sec=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9;
+    printf("%s trace:%llu records,%llu bytes,%.3f s,%.2f GB/s,"
+           "%.1f M records/s\n",t->binary?"binary":"text",records,t->bytes,
+           sec,t->bytes/sec/1e9,records/sec/1e6);
+}
+
+//report accesses/sec of run_cache for E=1..64 with every matcher
+//the stream cycles over S*E lines,so every set keeps E lines busy,
+//with one access in 8 to a random line to cause misses and evictions
+void bench_cache(int s,int b){
+
+    int i,j,E;
+    int n=1<<22;
+    int S=1<<s;
+    addr_type *addrs=(addr_type*)malloc(sizeof(addr_type)*n);
+    unsigned long long seed;
+    struct timespec t0,t1;
+    double sec;
+    cache my_cache;
+
+    if (addrs==NULL){
+        printf("Error:no memory for the benchmark\n");
+        exit(1);
+    }
+    printf("   E  matcher   accesses/sec       hits     misses  evictions\n");
+    for (E=1;E<=64;E*=2){
+        seed=0x9E3779B97F4A7C15ULL;
+        for (i=0;i<n;i++){
+            seed^=seed<<13;
+            seed^=seed>>7;
+            seed^=seed<<17;
+            if (seed%8==0){
+                addrs[i]=(seed>>3)<<b;
+            }else{
+                addrs[i]=(addr_type)((seed>>3)%((addr_type)S*E))<<b;
             }
         }
+        for (j=0;j<n_matchers;j++){
+            find_tag=matchers[j].match;
+            my_cache=init_cache(S,E,b);
+            hits=misses=evictions=0;
+            clock_gettime(CLOCK_MONOTONIC,&t0);
+            for (i=0;i<n;i++){
+                run_cache(&my_cache,addrs[i],s,E,b);
+            }
+            clock_gettime(CLOCK_MONOTONIC,&t1);
+            sec=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9;
+            printf("%4d %8s %14.0f %10d %10d %10d\n",E,matchers[j].name,
+                   n/sec,hits,misses,evictions);
+            free_cache(my_cache);
+        }
+    }
+    free(addrs);
+}
+
+//index of the previous access to the same line for every access,
+//-1 for the first one;lines of an open-addressing table map each
+//line to its latest access
+int *find_prev(addr_type *lines,long n){
 
-        //if missed and valid=1:eviction is needed
-        //LRU replacement policy to find victim line
-        if (evicted==true){
-            evictions+=1;
-            evict_index=find_LRU_line(my_cache.cacheSets[set],E);
-            my_cache.cacheSets[set].cacheLines[evict_index].LRU=0;
-            my_cache.cacheSets[set].cacheLines[evict_index].tag=addr_tag;
+    long i,j;
+    long cap=1<<16,used=0;
+    addr_type *keys;
+    int *last;
+    int *prev=(int*)malloc(sizeof(int)*n);
+    int shift=64-16;
+
+    keys=(addr_type*)malloc(sizeof(addr_type)*cap);
+    last=(int*)malloc(sizeof(int)*cap);
+    if (prev==NULL||keys==NULL||last==NULL){
+        printf("Error:no memory for the trace\n");
+        exit(1);
+    }
+    memset(last,-1,sizeof(int)*cap);
+
+    for (i=0;i<n;i++){
+        //keep the table at most half full
+        if (used*2>=cap){
+            addr_type *old_keys=keys;
+            int *old_last=last;
+            long old_cap=cap;
+
+            cap*=2;
+            shift--;
+            keys=(addr_type*)malloc(sizeof(addr_type)*cap);
+            last=(int*)malloc(sizeof(int)*cap);
+            if (keys==NULL||last==NULL){
+                printf("Error:no memory for the trace\n");
+                exit(1);
+            }
+            memset(last,-1,sizeof(int)*cap);
+            for (j=0;j<old_cap;j++){
+                if (old_last[j]>=0){
+                    long k=(long)((old_keys[j]*0x9E3779B97F4A7C15ULL)>>shift);
+                    while (last[k]>=0){
+                        k=(k+1)&(cap-1);
+                    }
+                    keys[k]=old_keys[j];
+                    last[k]=old_last[j];
+                }
+            }
+            free(old_keys);
+            free(old_last);
+        }
+
+        j=(long)((lines[i]*0x9E3779B97F4A7C15ULL)>>shift);
+        while (last[j]>=0&&keys[j]!=lines[i]){
+            j=(j+1)&(cap-1);
+        }
+        if (last[j]<0){
+            keys[j]=lines[i];
+            used++;
         }
+        prev[i]=last[j];
+        last[j]=(int)i;
     }
+    free(keys);
+    free(last);
+    return prev;
+}
 
-    return;
+//fenwick tree over positions 1..n:add v at position i
+void fenwick_add(int *tree,long n,long i,int v){
+
+    for (;i<=n;i+=i&-i){
+        tree[i]+=v;
+    }
 }
 
-//free malloc space in case segmentation fault
-void free_cache(cache my_cache,int s){
+//fenwick tree:sum of positions 1..i
+long fenwick_sum(int *tree,long i){
 
-    int i;
+    long sum=0;
+
+    for (;i>0;i-=i&-i){
+        sum+=tree[i];
+    }
+    return sum;
+}
+
+//miss-ratio curves of every set count up to 2**smax with every
+//associativity up to Emax (0:until no more hits come),in one run
+//over the trace per set count instead of one csim run per cache
+//
+//Mattson's stack algorithm:an access hits in an E-way LRU set iff
+//fewer than E other lines of its set were used since its last access,
+//its stack distance,so one histogram of distances gives the hits of
+//every E at once.a counting sort by set makes the accesses of each
+//set contiguous,and a fenwick tree of the set over them holds a 1 at
+//the latest access of each of its lines;the lines used since are the
+//lines seen so far less those marked up to the last access.
+//s=0 is the fully associative cache,E its capacity in lines;
+//evictions are the misses that found the set full,so every miss
+//but the first E of a set
+void run_mrc(trace_reader *t,int smax,int b,int Emax){
 
-    //free the space for each lines and sets
-    for (i=0;i<s;i++){
-        if (my_cache.cacheSets[i].cacheLines!=NULL){
-            free(my_cache.cacheSets[i].cacheLines);
+    static trace_rec recs[TRACE_BATCH];
+    long n=0,cap=1<<20,i,d,range;
+    long S,set,below,k,base,size,j;
+    int s,E,m;
+    addr_type *lines=(addr_type*)malloc(sizeof(addr_type)*cap);
+    int *prev,*pos,*last,*tree;
+    long *first,*next,*cold,*cold_count;
+    unsigned long long *hist=NULL;
+    long hist_cap=0,dmax;
+    unsigned long long hit_count,fills;
+
+    //line of every load and store,as run_cache sees them
+    if (lines==NULL){
+        printf("Error:no memory for the trace\n");
+        exit(1);
+    }
+    while ((m=trace_next(t,recs,TRACE_BATCH))>0){
+        for (i=0;i<m;i++){
+            if (recs[i].op!='L'&&recs[i].op!='S'){
+                continue;
+            }
+            if (n==cap){
+                cap*=2;
+                lines=(addr_type*)realloc(lines,sizeof(addr_type)*cap);
+                if (lines==NULL){
+                    printf("Error:no memory for the trace\n");
+                    exit(1);
+                }
+            }
+            lines[n++]=recs[i].address>>b;
         }
     }
-    
-    if (my_cache.cacheSets!=NULL){   
-        free(my_cache.cacheSets);
+    if (n>=INT_MAX){
+        printf("Error:trace too long for -m\n");
+        exit(1);
     }
 
-    return;
+    prev=find_prev(lines,n);
+    pos=(int*)malloc(sizeof(int)*(n+1));
+    last=(int*)malloc(sizeof(int)*(n+1));
+    tree=(int*)malloc(sizeof(int)*(n+1));
+    first=(long*)malloc(sizeof(long)*(((long)1<<smax)+1));
+    next=(long*)malloc(sizeof(long)*((long)1<<smax));
+    cold=(long*)malloc(sizeof(long)*((long)1<<smax));
+    if (pos==NULL||last==NULL||tree==NULL||first==NULL||next==NULL||cold==NULL){
+        printf("Error:no memory for the trace\n");
+        exit(1);
+    }
+
+    printf("   s        E           hits         misses      evictions\n");
+    for (s=0;s<=smax;s++){
+        S=(long)1<<s;
+
+        //the accesses of set k go to first[k]..first[k+1]-1 in time
+        //order;pos[i] is the place of access i within its set,from 1,
+        //and last[] holds,in set order,the place of the previous
+        //access to the same line (0 for none)
+        memset(first,0,sizeof(long)*(S+1));
+        for (i=0;i<n;i++){
+            first[(lines[i]&(S-1))+1]++;
+        }
+        for (set=0;set<S;set++){
+            first[set+1]+=first[set];
+            next[set]=0;
+        }
+        for (i=0;i<n;i++){
+            set=lines[i]&(S-1);
+            pos[i]=(int)(++next[set]);
+            last[first[set]+pos[i]-1]=prev[i]<0?0:pos[prev[i]];
+        }
+
+        //stack distances,one set at a time so its tree stays in cache
+        memset(tree,0,sizeof(int)*(n+1));
+        if (hist){
+            memset(hist,0,sizeof(unsigned long long)*hist_cap);
+        }
+        dmax=-1;
+        for (set=0;set<S;set++){
+            base=first[set];
+            size=first[set+1]-base;
+            cold[set]=0;
+            for (j=1;j<=size;j++){
+                if (last[base+j-1]==0){
+                    cold[set]++;
+                }else{
+                    d=cold[set]-fenwick_sum(tree+base,last[base+j-1]);
+                    if (d>=hist_cap){
+                        k=hist_cap;
+                        hist_cap=hist_cap?hist_cap:1024;
+                        while (d>=hist_cap){
+                            hist_cap*=2;
+                        }
+                        hist=(unsigned long long*)realloc(hist,
+                                sizeof(unsigned long long)*hist_cap);
+                        if (hist==NULL){
+                            printf("Error:no memory for the histogram\n");
+                            exit(1);
+                        }
+                        memset(hist+k,0,
+                               sizeof(unsigned long long)*(hist_cap-k));
+                    }
+                    hist[d]++;
+                    if (d>dmax){
+                        dmax=d;
+                    }
+                    fenwick_add(tree+base,size,last[base+j-1],-1);
+                }
+                fenwick_add(tree+base,size,j,1);
+            }
+        }
+
+        //number of sets with k cold misses,for the fills of each E
+        range=Emax>0?Emax:dmax+1;
+        if (range<1){
+            range=1;
+        }
+        cold_count=(long*)calloc(range,sizeof(long));
+        if (cold_count==NULL){
+            printf("Error:no memory for the histogram\n");
+            exit(1);
+        }
+        for (set=0;set<S;set++){
+            if (cold[set]<range){
+                cold_count[cold[set]]++;
+            }
+        }
+
+        hit_count=0;
+        fills=0;
+        below=0;   //sets with fewer than E lines
+        for (E=1;E<=range;E++){
+            if (E-1<hist_cap&&E-1<=dmax){
+                hit_count+=hist[E-1];
+            }
+            below+=cold_count[E-1];
+            fills+=S-below;
+            printf("%4d %8d %14llu %14llu %14llu\n",s,E,hit_count,
+                   n-hit_count,n-hit_count-fills);
+        }
+        free(cold_count);
+    }
+    free(lines);
+    free(prev);
+    free(pos);
+    free(last);
+    free(tree);
+    free(first);
+    free(next);
+    free(cold);
+    free(hist);
 }
 
 int main(int argc,char **argv){
 
     char c;              //for getopt()
-    char identifier;     //for fscanf
-    char *file;          
-    int s,S,E,b;         //# of sets;lines;blocks
-    int size;
-    FILE *trace;         //a pointer to file 
+    char *file=NULL;     //stdin without -t
+    char *convert=NULL;  //-c:write a binary trace here instead
+    int s=0,S,E=0,b=0;   //# of sets;lines;blocks,0 until given
+    int i,n;
+    static trace_rec recs[TRACE_BATCH];
+    trace_reader trace;
     cache my_cache;    
-    addr_type address;
+    bool bench=false;    //-B:benchmark the tag matchers instead
+    bool report=false;   //-p:only parse the trace,report GB/s
+    bool curves=false;   //-m:miss-ratio curves up to s sets and E lines
 	
     //parse command line arguments
     //s,E,b should be integers>0
-    while((c=getopt(argc,argv,"s:E:b:t:"))!=-1){
+    while((c=getopt(argc,argv,"s:E:b:t:Bc:pm"))!=-1){
         switch(c){
         case 's':
             s=atoi(optarg);
@@ -200,35 +916,72 @@ int main(int argc,char **argv){
         case 't':
             file=optarg;
             break;
+        case 'B':
+            bench=true;
+            break;
+        case 'c':
+            convert=optarg;
+            break;
+        case 'p':
+            report=true;
+            break;
+        case 'm':
+            curves=true;
+            break;
         default:
             printf("not correct parameters\n");
             exit(0);
         }
     }
 	
+    pick_matcher();
+    if (bench){
+        bench_cache(s,b);
+        return 0;
+    }
+
+    //simulating needs all of s,E,b;-m without -E goes on until no more hits
+    if (!convert&&!report&&(s==0||b==0||(E==0&&!curves))){
+        printf("Error:missing s,E or b\n");
+        exit(1);
+    }
+
+    //reading trace file
+    trace_open(&trace,file);
+    if (convert||report||curves){
+        if (convert){
+            trace_convert(&trace,convert);
+        }else if (report){
+            trace_report(&trace);
+        }else{
+            run_mrc(&trace,s,b,E);
+        }
+        trace_close(&trace);
+        return 0;
+    }
+
     //S=2**s,number of sets
 	S=1<<s;
     my_cache=init_cache(S,E,b);
   
-    //reading trace file
-    trace=fopen(file,"r");
-    
-    while(fscanf(trace," %c %llx,%d",&identifier,&address,&size)!= EOF){
-        switch(identifier){
-        //instruction: load or store data
-        case 'L':
-        case 'S':
-            run_cache(my_cache,address,s,E,b);
-            break;
-        default:
-            break;
+    while ((n=trace_next(&trace,recs,TRACE_BATCH))>0){
+        for (i=0;i<n;i++){
+            switch(recs[i].op){
+            //instruction: load or store data
+            case 'L':
+            case 'S':
+                run_cache(&my_cache,recs[i].address,s,E,b);
+                break;
+            default:
+                break;
+            }
         }
     }
     
     //results summary
     //close trace file and free the space
     printSummary(hits,misses,evictions);	   
-    fclose(trace);
-    free_cache(my_cache,S);
+    trace_close(&trace);
+    free_cache(my_cache);
     return 0;
 }
@@ -0,0 +1,162 @@
+/*
+ * memlib-os.c: memlib interface on real memory,for running mm.c as the
+ *              process allocator instead of under the lab driver
+ *
+ * build mm.c as a drop-in malloc (no -DDRIVER,so mm.c defines malloc,
+ * free,realloc,calloc,posix_memalign,malloc_usable_size... itself):
+ *   gcc -O2 -fPIC -shared -Wl,-Bsymbolic -DMM_THREADS -DNDEBUG \
+ *       -ftls-model=initial-exec -o libmm.so mm.c memlib-os.c -lpthread
+ *   LD_PRELOAD=./libmm.so <program> [args]
+ * -Bsymbolic keeps mm.c on these mem_* functions even in a program that
+ * has its own (mm-bench,the driver);initial-exec keeps the thread cache
+ * from being set up through a malloc call
+ *
+ * the heap is one contiguous range of address space reserved up front
+ * with PROT_NONE;mem_sbrk makes it accessible MEM_COMMIT bytes at a time,
+ * so untouched heap costs no memory and a stray pointer past the break
+ * still faults.the reservation is made on first use,mm.c calls mem_sbrk
+ * under heap_lock so no locking is needed here
+ *
+ * the reservation starts on a 2 MiB boundary,is madvise(MADV_HUGEPAGE)d
+ * and grows in whole 2 MiB steps,so with transparent huge pages set to
+ * "madvise" or "always" the heap is backed by huge pages and needs one
+ * dTLB entry per 2 MiB instead of one per 4 KiB
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+
+#define MEM_RESERVE ((size_t)1 << 36)   // 64 GiB of address space
+#define MEM_HUGE ((size_t)1 << 21)      // huge page size on x86-64
+#define MEM_COMMIT MEM_HUGE             // made accessible per step
+
+static char *mem_start_brk = NULL;  // first byte of the heap
+static char *mem_brk;               // current break
+static char *mem_committed;         // end of the accessible part
+static char *mem_max_addr;          // end of the reservation
+
+/*
+ * mem_init: reserve the address space of the heap on a huge page boundary
+ *
+ * map MEM_HUGE more than needed and unmap the ends around the aligned part
+ */
+void mem_init(void){
+
+    char *start = mmap(NULL, MEM_RESERVE + MEM_HUGE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    char *aligned;
+
+    if (start == MAP_FAILED){
+        // nothing sensible to fall back to this early
+        static const char msg[] = "memlib-os: cannot reserve heap\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        abort();
+    }
+    aligned = (char *)(((uintptr_t)start + MEM_HUGE - 1) & ~(MEM_HUGE - 1));
+    if (aligned > start){
+        munmap(start, aligned - start);
+    }
+    munmap(aligned + MEM_RESERVE, start + MEM_HUGE - aligned);
+#ifdef MADV_HUGEPAGE
+    // only a hint:it fails harmlessly where huge pages are off
+    madvise(aligned, MEM_RESERVE, MADV_HUGEPAGE);
+#endif
+    mem_start_brk = aligned;
+    mem_brk = mem_start_brk;
+    mem_committed = mem_start_brk;
+    mem_max_addr = mem_start_brk + MEM_RESERVE;
+}
+
+/*
+ * mem_deinit: give the whole reservation back
+ */
+void mem_deinit(void){
+
+    if (mem_start_brk){
+        munmap(mem_start_brk, MEM_RESERVE);
+        mem_start_brk = NULL;
+    }
+}
+
+/*
+ * mem_reset_brk: empty the heap,its pages are dropped as well
+ */
+void mem_reset_brk(void){
+
+    if (!mem_start_brk){
+        return;
+    }
+    madvise(mem_start_brk, mem_committed - mem_start_brk, MADV_DONTNEED);
+    mem_brk = mem_start_brk;
+}
+
+/*
+ * mem_sbrk: extend the heap by incr bytes and return the old break,
+ *           or (void *)-1 with errno set if it cannot grow
+ */
+void *mem_sbrk(intptr_t incr){
+
+    char *old_brk;
+    size_t grow;
+
+    if (!mem_start_brk){
+        mem_init();
+    }
+    old_brk = mem_brk;
+
+    if (incr < 0 || (size_t)incr > (size_t)(mem_max_addr - mem_brk)){
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    if (mem_brk + incr > mem_committed){
+        grow = (mem_brk + incr - mem_committed + MEM_COMMIT - 1)
+               & ~(MEM_COMMIT - 1);
+        if (grow > (size_t)(mem_max_addr - mem_committed)){
+            grow = mem_max_addr - mem_committed;
+        }
+        if (mprotect(mem_committed, grow, PROT_READ | PROT_WRITE) != 0){
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        mem_committed += grow;
+    }
+    mem_brk += incr;
+    return (void *)old_brk;
+}
+
+void *mem_heap_lo(void){
+
+    return (void *)mem_start_brk;
+}
+
+void *mem_heap_hi(void){
+
+    return (void *)(mem_brk - 1);
+}
+
+size_t mem_heapsize(void){
+
+    return (size_t)(mem_brk - mem_start_brk);
+}
+
+size_t mem_pagesize(void){
+
+    return (size_t)getpagesize();
+}
+
+void *mem_memset(void *ptr, int c, size_t n){
+
+    return memset(ptr, c, n);
+}
+
+void *mem_memcpy(void *dst, const void *src, size_t n){
+
+    return memcpy(dst, src, n);
+}
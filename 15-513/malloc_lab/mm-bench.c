@@ -0,0 +1,905 @@
+/*
+ * mm-bench.c: benchmarks for the mm.c allocator
+ *
+ * build next to the lab's memlib.c:
+ *   gcc -O2 -DDRIVER -DMM_THREADS -o mm-bench mm-bench.c mm.c memlib.c -lpthread
+ *
+ * usage: mm-bench <benchmark> [options]
+ *   -s     run against the system malloc instead of mm.c (for comparison)
+ *   -n N   largest number of threads (default 8)
+ *   -i N   operations per thread (default 1000000)
+ *
+ * benchmarks:
+ *   threads   random alloc/free mix on every thread,ops/sec for 1..N threads
+ *   rss       phase-shifting allocations,resident set size after each phase
+ *   arena     request-shaped bursts,per-object malloc/free against an arena
+ *             (-i is the number of requests,-s only affects malloc/free)
+ *   calloc    latency of large calloc calls and the RSS they add
+ *   pingpong  malloc/free of blocks just above the slab sizes,ops/sec
+ *             with one object in flight and with a small ring of them
+ *   batch     BATCH_OBJECTS objects of one size at a time,n malloc/free
+ *             calls against mm_malloc_batch/mm_free_batch
+ *   dtlb      pointer chase through small objects allocated between larger
+ *             ones:dTLB load misses (perf_event_open,n/a where perf is not
+ *             allowed),ns per access and the AnonHugePages of the process.
+ *             mm.c only packs slabs into huge pages as the process malloc,
+ *             so compare `LD_PRELOAD=./libmm.so mm-bench dtlb -s` (see
+ *             memlib-os.c) with plain `mm-bench dtlb -s`
+ *   pc        producer/consumer pairs:each producer allocates small objects
+ *             and passes them through a ring to its consumer,which frees
+ *             them;objects/sec for 1..N/2 pairs
+ *   prof      the threads mix on one thread with the profiler off and at
+ *             a few sampling rates:ops/sec,samples taken and the cost of
+ *             one sample,then the size of the profile it dumps;last,
+ *             mm_free_batch on sampled objects with mm_checkheap after
+ *             every batch
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm-ext.h"
+
+#define SLOTS 1024          // live objects per thread
+#define RSS_SMALL 200000    // small objects kept through the rss phases
+#define RSS_MEDIUM 1000     // medium objects of the rss benchmark
+#define RSS_BUFFER (100 << 20)
+#define REQUEST_OBJECTS 512 // most objects allocated by one request
+#define CALLOC_TOTAL (256 << 20)    // bytes held by each calloc round
+#define PINGPONG_RING 16    // objects in flight in the ring pattern
+#define BATCH_OBJECTS 256   // objects per batch
+#define PROF_BATCH_RATE 4096    // sampling rate of the batch free check
+#define PROF_BATCH_ROUNDS 2000  // batches it frees
+#define DTLB_NODES (1 << 20)    // small objects chased by the dtlb benchmark
+#define DTLB_SPACING 4      // one larger object after every this many nodes
+#define PC_RING 1024        // objects in flight between a producer and consumer
+
+typedef void *(*malloc_fn)(size_t size);
+typedef void (*free_fn)(void *ptr);
+typedef void *(*calloc_fn)(size_t elements, size_t size);
+
+/* allocator under test */
+static malloc_fn bench_malloc = mm_malloc;
+static free_fn bench_free = mm_free;
+static calloc_fn bench_calloc = mm_calloc;
+
+/* command line options */
+static int max_threads = 8;
+static long iterations = 1000000;
+
+static pthread_barrier_t start_barrier;
+
+/* single-producer single-consumer ring of the pc benchmark */
+typedef struct {
+    void *slot[PC_RING];
+    size_t head;        // next slot the producer fills,written by it only
+    size_t tail;        // next slot the consumer takes,written by it only
+    uint64_t seed;
+} pc_ring_t;
+
+static void bench_threads(void);
+static void bench_rss(void);
+static void report_rss(const char *phase);
+static long rss_kib(void);
+static void bench_arena(void);
+static size_t request_objects(uint64_t *seed, size_t *sizes);
+static void bench_calloc_large(void);
+static void bench_pingpong(void);
+static void bench_batch(void);
+static void bench_dtlb(void);
+static void bench_pc(void);
+static void *pc_producer(void *arg);
+static void *pc_consumer(void *arg);
+static void bench_prof(void);
+static long prof_samples(const char *path);
+static void prof_batch(void);
+static int dtlb_counter(void);
+static long anon_huge_kib(void);
+static void *threads_worker(void *arg);
+static size_t random_size(uint64_t *seed);
+static uint64_t xorshift(uint64_t *seed);
+static double now_sec(void);
+
+/* benchmarks by name */
+static const struct {
+    const char *name;
+    void (*run)(void);
+} benchmarks[] = {
+    {"threads", bench_threads},
+    {"rss", bench_rss},
+    {"arena", bench_arena},
+    {"calloc", bench_calloc_large},
+    {"pingpong", bench_pingpong},
+    {"batch", bench_batch},
+    {"dtlb", bench_dtlb},
+    {"pc", bench_pc},
+    {"prof", bench_prof},
+};
+
+int main(int argc, char **argv){
+
+    int c;
+    size_t i;
+    const char *name;
+
+    if (argc < 2){
+        fprintf(stderr, "usage: %s <benchmark> [-s] [-n threads] [-i ops]\n",
+                argv[0]);
+        exit(1);
+    }
+    name = argv[1];
+
+    optind = 2;
+    while ((c = getopt(argc, argv, "sn:i:")) != -1){
+        switch (c){
+        case 's':
+            bench_malloc = malloc;
+            bench_free = free;
+            bench_calloc = calloc;
+            break;
+        case 'n':
+            max_threads = atoi(optarg);
+            break;
+        case 'i':
+            iterations = atol(optarg);
+            break;
+        default:
+            exit(1);
+        }
+    }
+
+    mem_init();
+    if (!mm_init()){
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+
+    for (i = 0; i < sizeof(benchmarks)/sizeof(benchmarks[0]); i++){
+        if (!strcmp(name, benchmarks[i].name)){
+            benchmarks[i].run();
+            return 0;
+        }
+    }
+    fprintf(stderr, "unknown benchmark: %s\n", name);
+    return 1;
+}
+
+/*
+ * bench_threads: alloc/free stress from 1 to max_threads threads
+ *
+ * every thread owns SLOTS slots and either frees or fills a random one,
+ * so allocations and frees stay balanced and mostly small
+ */
+static void bench_threads(void){
+
+    int n, t;
+    double start, elapsed;
+    pthread_t tid[max_threads];
+
+    printf("%8s %14s %14s\n", "threads", "ops/sec", "ops/sec/thread");
+    for (n = 1; n <= max_threads; n++){
+        pthread_barrier_init(&start_barrier, NULL, n + 1);
+        for (t = 0; t < n; t++){
+            pthread_create(&tid[t], NULL, threads_worker,
+                           (void *)(uintptr_t)(t + 1));
+        }
+        pthread_barrier_wait(&start_barrier);
+        start = now_sec();
+        for (t = 0; t < n; t++){
+            pthread_join(tid[t], NULL);
+        }
+        elapsed = now_sec() - start;
+        pthread_barrier_destroy(&start_barrier);
+
+        printf("%8d %14.0f %14.0f\n", n, n * iterations / elapsed,
+               iterations / elapsed);
+    }
+}
+
+static void *threads_worker(void *arg){
+
+    long i;
+    size_t slot;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL * (uintptr_t)arg;
+    void **slots = calloc(SLOTS, sizeof(void *));
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < iterations; i++){
+        slot = xorshift(&seed) % SLOTS;
+        if (slots[slot]){
+            bench_free(slots[slot]);
+            slots[slot] = NULL;
+        }else{
+            slots[slot] = bench_malloc(random_size(&seed));
+            //touch the first byte like a real user would
+            *(char *)slots[slot] = (char)i;
+        }
+    }
+    for (slot = 0; slot < SLOTS; slot++){
+        bench_free(slots[slot]);
+    }
+    free(slots);
+    return NULL;
+}
+
+/*
+ * bench_rss: grow and shrink the footprint in phases and print the
+ *            resident set size after each one
+ *
+ * memory freed in a phase should stop counting once large blocks are
+ * unmapped and big free spans have given their pages back
+ */
+static void bench_rss(void){
+
+    size_t i, size;
+    uint64_t seed = 42;
+    void **small = malloc(RSS_SMALL * sizeof(void *));
+    void **medium = malloc(RSS_MEDIUM * sizeof(void *));
+    char *buffer;
+
+    printf("%-22s %12s\n", "phase", "rss KiB");
+    report_rss("start");
+
+    for (i = 0; i < RSS_SMALL; i++){
+        small[i] = bench_malloc(1 + xorshift(&seed) % 256);
+        memset(small[i], 1, 1);
+    }
+    report_rss("small objects");
+
+    for (i = 0; i < RSS_MEDIUM; i++){
+        size = 4096 + xorshift(&seed) % (60 << 10);
+        medium[i] = bench_malloc(size);
+        memset(medium[i], 1, size);
+    }
+    report_rss("medium objects");
+
+    for (i = 0; i < RSS_MEDIUM; i++){
+        bench_free(medium[i]);
+    }
+    report_rss("medium freed");
+
+    buffer = bench_malloc(RSS_BUFFER);
+    memset(buffer, 1, RSS_BUFFER);
+    report_rss("100 MiB buffer");
+
+    bench_free(buffer);
+    report_rss("buffer freed");
+
+    for (i = 0; i < RSS_SMALL; i += 2){
+        bench_free(small[i]);
+    }
+    report_rss("half small freed");
+
+    for (i = 1; i < RSS_SMALL; i += 2){
+        bench_free(small[i]);
+    }
+    report_rss("all freed");
+
+    free(small);
+    free(medium);
+}
+
+/*
+ * report_rss: print the resident set size after a phase
+ */
+static void report_rss(const char *phase){
+
+    printf("%-22s %12ld\n", phase, rss_kib());
+}
+
+/*
+ * rss_kib: resident set size in KiB from /proc/self/statm
+ */
+static long rss_kib(void){
+
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp){
+        if (fscanf(fp, "%ld %ld", &pages, &resident) != 2){
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+/*
+ * bench_arena: serve the same stream of requests twice,once with a
+ *              malloc/free per object and once from an arena reset
+ *              at the end of every request
+ *
+ * a request allocates a random number of mostly small objects,
+ * touches them and drops them all together
+ */
+static void bench_arena(void){
+
+    long r;
+    size_t i, n;
+    size_t sizes[REQUEST_OBJECTS];
+    void *objs[REQUEST_OBJECTS];
+    uint64_t seed;
+    uint64_t objects = 0;
+    double start, t_malloc, t_arena;
+    mm_arena_t *arena;
+
+    seed = 7;
+    start = now_sec();
+    for (r = 0; r < iterations / 100; r++){
+        n = request_objects(&seed, sizes);
+        for (i = 0; i < n; i++){
+            objs[i] = bench_malloc(sizes[i]);
+            *(char *)objs[i] = (char)i;
+        }
+        for (i = 0; i < n; i++){
+            bench_free(objs[i]);
+        }
+        objects += n;
+    }
+    t_malloc = now_sec() - start;
+
+    seed = 7;
+    if ((arena = mm_arena_create(0)) == NULL){
+        fprintf(stderr, "mm_arena_create failed\n");
+        exit(1);
+    }
+    start = now_sec();
+    for (r = 0; r < iterations / 100; r++){
+        n = request_objects(&seed, sizes);
+        for (i = 0; i < n; i++){
+            objs[i] = mm_arena_alloc(arena, sizes[i]);
+            *(char *)objs[i] = (char)i;
+        }
+        mm_arena_reset(arena);
+    }
+    t_arena = now_sec() - start;
+    mm_arena_destroy(arena);
+
+    printf("%ld requests, %lu objects\n", iterations / 100,
+           (unsigned long)objects);
+    printf("%-14s %12s %12s\n", "", "ns/object", "ms total");
+    printf("%-14s %12.1f %12.1f\n", "malloc/free",
+           t_malloc * 1e9 / objects, t_malloc * 1e3);
+    printf("%-14s %12.1f %12.1f\n", "arena",
+           t_arena * 1e9 / objects, t_arena * 1e3);
+}
+
+/*
+ * bench_calloc_large: calloc CALLOC_TOTAL bytes in blocks of one size,
+ *                     report the time per call and how much RSS it added
+ *
+ * the blocks are not touched,so memory that calloc does not have to
+ * clear itself should not show up as resident
+ */
+static void bench_calloc_large(void){
+
+    static const size_t sizes[] = {
+        16 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20, 16 << 20
+    };
+    size_t i, j, n;
+    long rss;
+    double start, elapsed;
+    void **blocks = malloc((CALLOC_TOTAL / sizes[0]) * sizeof(void *));
+
+    printf("%10s %8s %14s %14s\n", "size KiB", "calls", "us/calloc",
+           "rss grow KiB");
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        n = CALLOC_TOTAL / sizes[i];
+        rss = rss_kib();
+        start = now_sec();
+        for (j = 0; j < n; j++){
+            if ((blocks[j] = bench_calloc(1, sizes[i])) == NULL){
+                fprintf(stderr, "calloc failed\n");
+                exit(1);
+            }
+        }
+        elapsed = now_sec() - start;
+        rss = rss_kib() - rss;
+        for (j = 0; j < n; j++){
+            bench_free(blocks[j]);
+        }
+        printf("%10zu %8zu %14.2f %14ld\n", sizes[i] >> 10, n,
+               elapsed * 1e6 / n, rss);
+    }
+    free(blocks);
+}
+
+/*
+ * bench_pingpong: free a block and ask for one of the same size again,
+ *                 the pattern where coalescing on free is wasted work
+ *
+ * "single" frees each block before the next malloc,"ring" keeps
+ * PINGPONG_RING blocks of mixed sizes live and replaces the oldest
+ */
+static void bench_pingpong(void){
+
+    static const size_t sizes[] = {272, 512, 1000};
+    size_t i, j;
+    long k;
+    void *bp;
+    void *ring[PINGPONG_RING];
+    size_t ring_size[PINGPONG_RING];
+    uint64_t seed = 11;
+    double start, elapsed;
+
+    printf("%-10s %8s %14s\n", "pattern", "size", "ops/sec");
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        start = now_sec();
+        for (k = 0; k < iterations; k++){
+            bp = bench_malloc(sizes[i]);
+            *(char *)bp = (char)k;
+            bench_free(bp);
+        }
+        elapsed = now_sec() - start;
+        printf("%-10s %8zu %14.0f\n", "single", sizes[i],
+               2 * iterations / elapsed);
+    }
+
+    for (j = 0; j < PINGPONG_RING; j++){
+        ring_size[j] = 257 + xorshift(&seed) % 768;
+        ring[j] = bench_malloc(ring_size[j]);
+    }
+    start = now_sec();
+    for (k = 0; k < iterations; k++){
+        j = k % PINGPONG_RING;
+        bench_free(ring[j]);
+        ring[j] = bench_malloc(ring_size[j]);
+        *(char *)ring[j] = (char)k;
+    }
+    elapsed = now_sec() - start;
+    for (j = 0; j < PINGPONG_RING; j++){
+        bench_free(ring[j]);
+    }
+    printf("%-10s %8s %14.0f\n", "ring", "257-1024", 2 * iterations / elapsed);
+}
+
+/*
+ * bench_batch: allocate,touch and free BATCH_OBJECTS objects of one size,
+ *              once with a call per object and once with the batch calls
+ *
+ * the objects are freed in a shuffled order,like messages that finish
+ * out of order (-s only affects the per-object calls)
+ */
+static void bench_batch(void){
+
+    static const size_t sizes[] = {64, 512, 2048};
+    void *objs[BATCH_OBJECTS];
+    size_t i, j, k;
+    long r, batches = iterations / BATCH_OBJECTS;
+    uint64_t seed = 3;
+    void *tmp;
+    double start, t_single, t_batch;
+
+    printf("%8s %16s %16s\n", "size", "single ns/obj", "batch ns/obj");
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        start = now_sec();
+        for (r = 0; r < batches; r++){
+            for (j = 0; j < BATCH_OBJECTS; j++){
+                objs[j] = bench_malloc(sizes[i]);
+                *(char *)objs[j] = (char)j;
+            }
+            for (j = BATCH_OBJECTS - 1; j > 0; j--){
+                k = xorshift(&seed) % (j + 1);
+                tmp = objs[j], objs[j] = objs[k], objs[k] = tmp;
+            }
+            for (j = 0; j < BATCH_OBJECTS; j++){
+                bench_free(objs[j]);
+            }
+        }
+        t_single = now_sec() - start;
+
+        start = now_sec();
+        for (r = 0; r < batches; r++){
+            if (mm_malloc_batch(sizes[i], BATCH_OBJECTS, objs) != BATCH_OBJECTS){
+                fprintf(stderr, "mm_malloc_batch failed\n");
+                exit(1);
+            }
+            for (j = 0; j < BATCH_OBJECTS; j++){
+                *(char *)objs[j] = (char)j;
+            }
+            for (j = BATCH_OBJECTS - 1; j > 0; j--){
+                k = xorshift(&seed) % (j + 1);
+                tmp = objs[j], objs[j] = objs[k], objs[k] = tmp;
+            }
+            mm_free_batch(objs, BATCH_OBJECTS);
+        }
+        t_batch = now_sec() - start;
+
+        printf("%8zu %16.1f %16.1f\n", sizes[i],
+               t_single * 1e9 / (batches * BATCH_OBJECTS),
+               t_batch * 1e9 / (batches * BATCH_OBJECTS));
+    }
+}
+
+/*
+ * bench_dtlb: chase a random cycle through DTLB_NODES small objects
+ *             that were allocated between larger ones
+ *
+ * the larger objects stay allocated,so an allocator that puts small
+ * objects next to them spreads the cycle over many more pages
+ */
+static void bench_dtlb(void){
+
+    void **nodes = malloc(DTLB_NODES * sizeof(void *));
+    void **spacers = malloc(DTLB_NODES / DTLB_SPACING * sizeof(void *));
+    void **p, *tmp;
+    size_t i, j;
+    long k;
+    uint64_t seed = 5, misses = 0;
+    int fd;
+    double start, elapsed;
+
+    if (!nodes || !spacers){
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < DTLB_NODES; i++){
+        nodes[i] = bench_malloc(sizeof(void *) + xorshift(&seed) % 249);
+        if (i % DTLB_SPACING == 0){
+            spacers[i / DTLB_SPACING] =
+                bench_malloc(512 + xorshift(&seed) % 3584);
+        }
+    }
+
+    // link the nodes into one cycle in random order
+    for (i = DTLB_NODES - 1; i > 0; i--){
+        j = xorshift(&seed) % (i + 1);
+        tmp = nodes[i], nodes[i] = nodes[j], nodes[j] = tmp;
+    }
+    for (i = 0; i < DTLB_NODES; i++){
+        *(void **)nodes[i] = nodes[(i + 1) % DTLB_NODES];
+    }
+
+    fd = dtlb_counter();
+    if (fd >= 0){
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    start = now_sec();
+    p = nodes[0];
+    for (k = 0; k < iterations; k++){
+        p = *p;
+    }
+    elapsed = now_sec() - start;
+    if (fd >= 0){
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)){
+            misses = 0;
+        }
+        close(fd);
+    }
+
+    printf("%-22s %12.1f\n", "ns/access", elapsed * 1e9 / iterations);
+    if (fd >= 0){
+        printf("%-22s %12.3f\n", "dtlb misses/access",
+               (double)misses / iterations);
+    }else{
+        printf("%-22s %12s\n", "dtlb misses/access", "n/a");
+    }
+    printf("%-22s %12ld\n", "AnonHugePages KiB", anon_huge_kib());
+    printf("%-22s %12ld\n", "rss KiB", rss_kib());
+
+    for (i = 0; i < DTLB_NODES; i++){
+        bench_free(nodes[i]);
+    }
+    for (i = 0; i < DTLB_NODES / DTLB_SPACING; i++){
+        bench_free(spacers[i]);
+    }
+    free(nodes);
+    free(spacers);
+    if (p == NULL){
+        printf("broken cycle\n");  // keeps the chase from being optimized out
+    }
+}
+
+/*
+ * dtlb_counter: perf event counting dTLB load misses of this thread
+ *               in user space,-1 if perf is not available
+ */
+static int dtlb_counter(void){
+
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+                  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * anon_huge_kib: anonymous memory backed by huge pages,in KiB
+ *                from /proc/self/smaps_rollup (0 if it cannot be read)
+ */
+static long anon_huge_kib(void){
+
+    char line[256];
+    long kib = 0;
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+
+    if (fp){
+        while (fgets(line, sizeof(line), fp)){
+            if (sscanf(line, "AnonHugePages: %ld", &kib) == 1){
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    return kib;
+}
+
+/*
+ * bench_pc: 1 to max_threads/2 producer/consumer pairs,iterations
+ *           objects per pair
+ *
+ * every object is freed by another thread than the one that allocated
+ * it,the pattern of a pipeline handing requests between stages
+ */
+static void bench_pc(void){
+
+    int n, t;
+    double start, elapsed;
+    int pairs = max_threads / 2 > 0 ? max_threads / 2 : 1;
+    pthread_t tid[2 * pairs];
+    pc_ring_t *rings = calloc(pairs, sizeof(pc_ring_t));
+
+    printf("%8s %14s %14s\n", "pairs", "objects/sec", "objects/sec/pair");
+    for (n = 1; n <= pairs; n++){
+        pthread_barrier_init(&start_barrier, NULL, 2 * n + 1);
+        for (t = 0; t < n; t++){
+            memset(&rings[t], 0, sizeof(pc_ring_t));
+            rings[t].seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+            pthread_create(&tid[2*t], NULL, pc_producer, &rings[t]);
+            pthread_create(&tid[2*t + 1], NULL, pc_consumer, &rings[t]);
+        }
+        pthread_barrier_wait(&start_barrier);
+        start = now_sec();
+        for (t = 0; t < 2 * n; t++){
+            pthread_join(tid[t], NULL);
+        }
+        elapsed = now_sec() - start;
+        pthread_barrier_destroy(&start_barrier);
+
+        printf("%8d %14.0f %14.0f\n", n, n * iterations / elapsed,
+               iterations / elapsed);
+    }
+    free(rings);
+}
+
+static void *pc_producer(void *arg){
+
+    pc_ring_t *ring = arg;
+    long i;
+    size_t size;
+    void *bp;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < iterations; i++){
+        size = 16 + xorshift(&ring->seed) % 241;
+        bp = bench_malloc(size);
+        memset(bp, (int)i, size);
+        while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+               == PC_RING){
+            sched_yield();
+        }
+        ring->slot[ring->head % PC_RING] = bp;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *pc_consumer(void *arg){
+
+    pc_ring_t *ring = arg;
+    long i;
+    void *bp;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < iterations; i++){
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail){
+            sched_yield();
+        }
+        bp = ring->slot[ring->tail % PC_RING];
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+        if (*(volatile char *)bp != (char)i){
+            fprintf(stderr, "pc: object %ld corrupted\n", i);
+            exit(1);
+        }
+        bench_free(bp);
+    }
+    return NULL;
+}
+
+/*
+ * bench_prof: random alloc/free mix of threads_worker with sampling off,
+ *             then at each rate of rates;the cost of a sample is the
+ *             time over the unsampled run divided by the samples taken
+ *
+ * all samples of a run have the same few stacks,so the profile stays
+ * small;its first line gives the samples taken (-s is ignored here)
+ */
+static void bench_prof(void){
+
+    static const size_t rates[] = {0, 1 << 19, 1 << 16};
+    static const char *path = "mm-bench.heap";
+    void *slots[SLOTS] = {NULL};
+    size_t i, slot;
+    long k, samples, samples_before = 0;
+    uint64_t seed;
+    double start, elapsed, base = 0;
+    FILE *fp;
+
+    printf("%8s %14s %10s %14s\n", "rate", "ops/sec", "samples",
+           "ns/sample");
+    for (i = 0; i < sizeof(rates)/sizeof(rates[0]); i++){
+        mm_mallopt(MM_OPT_PROF_SAMPLE, rates[i]);
+        seed = 0x9E3779B97F4A7C15ULL;
+        start = now_sec();
+        for (k = 0; k < iterations; k++){
+            slot = xorshift(&seed) % SLOTS;
+            if (slots[slot]){
+                mm_free(slots[slot]);
+                slots[slot] = NULL;
+            }else{
+                slots[slot] = mm_malloc(random_size(&seed));
+                *(char *)slots[slot] = (char)k;
+            }
+        }
+        elapsed = now_sec() - start;
+        for (slot = 0; slot < SLOTS; slot++){
+            mm_free(slots[slot]);
+            slots[slot] = NULL;
+        }
+
+        // the profile counts every sample ever taken
+        if ((fp = fopen(path, "w")) == NULL || mm_prof_dump(fp) != 0){
+            fprintf(stderr, "cannot write %s\n", path);
+            exit(1);
+        }
+        fclose(fp);
+        samples = prof_samples(path) - samples_before;
+        samples_before += samples;
+        if (rates[i] == 0){
+            base = elapsed;
+            printf("%8s %14.0f %10ld %14s\n", "off", iterations / elapsed,
+                   samples, "-");
+        }else{
+            printf("%8zu %14.0f %10ld %14.0f\n", rates[i],
+                   iterations / elapsed, samples,
+                   samples ? (elapsed - base) * 1e9 / samples : 0.0);
+        }
+    }
+    mm_mallopt(MM_OPT_PROF_SAMPLE, 0);
+    printf("profile written to %s\n", path);
+    prof_batch();
+}
+
+/*
+ * prof_batch: malloc BATCH_OBJECTS objects of random sizes at a time with
+ *             a sample every few KiB and free the batches in turn through
+ *             mm_free_batch,mm_free and mm_free_sized,so sampled mappings
+ *             (which carry the fourth bit) meet the runs mm_free_batch
+ *             merges and small ones the sized free that skips the mapping
+ *             check;the heap is checked after each batch,and no mapping
+ *             may be left once all are freed
+ */
+static void prof_batch(void){
+
+    void *objs[BATCH_OBJECTS];
+    size_t sizes[BATCH_OBJECTS];
+    size_t i;
+    long r;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    mm_stats_t st;
+
+    mm_mallopt(MM_OPT_PROF_SAMPLE, PROF_BATCH_RATE);
+    for (r = 0; r < PROF_BATCH_ROUNDS; r++){
+        for (i = 0; i < BATCH_OBJECTS; i++){
+            sizes[i] = random_size(&seed);
+            objs[i] = mm_malloc(sizes[i]);
+            *(char *)objs[i] = (char)i;
+        }
+        if (r % 3 == 0){
+            mm_free_batch(objs, BATCH_OBJECTS);
+        }else{
+            for (i = 0; i < BATCH_OBJECTS; i++){
+                if (r % 3 == 1){
+                    mm_free(objs[i]);
+                }else{
+                    mm_free_sized(objs[i], sizes[i]);
+                }
+            }
+        }
+        if (!mm_checkheap(__LINE__)){
+            fprintf(stderr, "heap check failed after batch %ld\n", r);
+            exit(1);
+        }
+    }
+    mm_mallopt(MM_OPT_PROF_SAMPLE, 0);
+    mm_stats(&st);
+    if (st.mapped != 0){
+        fprintf(stderr, "%zu mapped bytes left after the batches\n",
+                st.mapped);
+        exit(1);
+    }
+    printf("batch free with sampling: %d batches ok\n", PROF_BATCH_ROUNDS);
+}
+
+/*
+ * prof_samples: samples ever taken,from the header of a profile
+ */
+static long prof_samples(const char *path){
+
+    long live, live_bytes, samples = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp){
+        if (fscanf(fp, "heap profile: %ld: %ld [%ld:", &live, &live_bytes,
+                   &samples) != 3){
+            samples = 0;
+        }
+        fclose(fp);
+    }
+    return samples;
+}
+
+/*
+ * request_objects: sizes of the objects one request allocates,
+ *                  returns how many there are
+ */
+static size_t request_objects(uint64_t *seed, size_t *sizes){
+
+    size_t i, n = 1 + xorshift(seed) % REQUEST_OBJECTS;
+
+    for (i = 0; i < n; i++){
+        sizes[i] = random_size(seed);
+    }
+    return n;
+}
+
+/*
+ * random_size: request sizes skewed to small objects,
+ *              90% up to 256 bytes and the rest up to 4 KiB
+ */
+static size_t random_size(uint64_t *seed){
+
+    uint64_t r = xorshift(seed);
+
+    if (r % 10){
+        return 1 + (r >> 8) % 256;
+    }
+    return 1 + (r >> 8) % 4096;
+}
+
+static uint64_t xorshift(uint64_t *seed){
+
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+static double now_sec(void){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
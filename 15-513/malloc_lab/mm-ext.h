@@ -0,0 +1,106 @@
+/*
+ * mm-ext.h: interface of mm.c beyond the lab's mm.h
+ */
+
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* mm_mallopt parameters */
+#define MM_OPT_MMAP_THRESHOLD 1  /* requests this large get their own mapping */
+#define MM_OPT_TRIM_THRESHOLD 2  /* free blocks this large give pages back */
+#define MM_OPT_PROF_SAMPLE 3     /* mean bytes between sampled allocations,
+                                    0 (the default) turns sampling off */
+
+/*
+ * mm_mallopt: set an allocator parameter,returns 1 on success and 0
+ *             for an unknown parameter
+ */
+extern int mm_mallopt(int param, size_t value);
+
+/*
+ * allocator statistics,kept up to date by every call
+ *
+ * heap bytes are split into in_use (allocated blocks,including slabs and
+ * arena chunks),quick (freed blocks the quick lists hold back from
+ * coalescing) and free;mapped blocks are counted apart.mallocs and
+ * frees include the calls realloc and calloc make themselves
+ */
+#define MM_STATS_CLASSES 64
+
+typedef struct
+{
+    size_t heap_size;       /* bytes obtained from mem_sbrk */
+    size_t in_use;          /* heap bytes in allocated blocks */
+    size_t peak_in_use;
+    size_t free;            /* heap bytes in free blocks */
+    size_t largest_free;    /* size of the biggest free block */
+    double fragmentation;   /* 1 - largest_free/free,0 with nothing free */
+    size_t quick;           /* heap bytes on the quick lists */
+    size_t mapped;          /* bytes of blocks with their own mapping */
+    size_t free_class[MM_STATS_CLASSES]; /* free bytes,sizes in [2^i,2^(i+1)) */
+    unsigned long long mallocs, frees, reallocs, callocs;
+    unsigned long long splits, coalesces, extends, mmaps, munmaps;
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *st);
+extern void mm_stats_print(FILE *fp);
+
+/*
+ * allocation profiler,sampling set with MM_OPT_PROF_SAMPLE
+ *
+ *   mm_prof_dump(fp)            write the live sampled allocations per
+ *                               stack as a pprof heap profile
+ *                               (pprof <program> <file>)
+ *   mm_prof_signal(signo, path) dump to path.<pid>.<n>.heap on signo
+ *
+ * malloc,calloc and realloc are sampled;memalign beyond 16 bytes and
+ * mm_malloc_batch are not.as the LD_PRELOAD malloc,MM_PROF_SAMPLE=<bytes>
+ * in the environment starts it with dumps on SIGUSR2 (MM_PROF_FILE sets
+ * the prefix)
+ */
+extern int mm_prof_dump(FILE *fp);
+extern int mm_prof_signal(int signo, const char *path);
+
+/*
+ * aligned allocation,usable size and sized free,under the driver names
+ * mm.c is built with;free() releases the result as usual
+ */
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
+extern size_t mm_malloc_usable_size(void *bp);
+extern void mm_free_sized(void *bp, size_t size);
+
+/*
+ * batches of same-sized objects under one lock round trip
+ *
+ *   mm_malloc_batch(size, n, out)  fill out[0..n) with size-byte blocks,
+ *                                  return how many it got (n unless out
+ *                                  of memory)
+ *   mm_free_batch(ptrs, n)         free n pointers from anywhere,
+ *                                  null entries are skipped
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/*
+ * arenas:bump allocation for objects that die together
+ *
+ *   mm_arena_create(chunk_size)  new arena,0 picks the default chunk size
+ *   mm_arena_alloc(arena, size)  16-byte aligned memory,never freed alone
+ *   mm_arena_reset(arena)        free every object,keep one chunk for reuse
+ *   mm_arena_destroy(arena)      free every object and the arena
+ *
+ * an arena must only be used by one thread at a time
+ */
+typedef struct mm_arena mm_arena_t;
+
+extern mm_arena_t *mm_arena_create(size_t chunk_size);
+extern void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+extern void mm_arena_reset(mm_arena_t *arena);
+extern void mm_arena_destroy(mm_arena_t *arena);
+
+#endif /* MM_EXT_H */
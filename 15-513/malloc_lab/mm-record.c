@@ -0,0 +1,460 @@
+/*
+ * mm-record.c: record the allocation calls of a running program as a
+ *              binary trace that mm-replay can play back
+ *
+ * build:
+ *   gcc -O2 -shared -fPIC -o mm-record.so mm-record.c -ldl -lpthread
+ * usage:
+ *   MM_RECORD=trace.bin LD_PRELOAD=./mm-record.so <program> [args]
+ * (MM_RECORD defaults to mm-trace.bin)
+ *
+ * malloc/calloc/realloc/free and the aligned variants are passed on to
+ * the next allocator and logged in the format read by mm-replay:
+ * "MMTRACE1",then per call a/r/f,the id and the size as LEB128 varints.
+ * calloc and aligned allocations are logged as plain allocations.
+ * live pointers map to small ids through an open-addressing table;
+ * freed ids are reused so the replay's pointer table stays small.
+ * calls are serialized by one lock,which also keeps the log in the
+ * order the calls took effect.memory of the recorder itself comes from
+ * mmap so it never shows up in the trace;forked children are not recorded
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define TRACE_MAGIC "MMTRACE1"
+#define OUT_BUFFER (1 << 16)
+#define BOOT_HEAP 8192      // served while dlsym itself allocates
+
+typedef struct {
+    void *ptr;              // null marks an empty slot
+    size_t id;
+} entry_t;
+
+static void *(*real_malloc)(size_t size);
+static void *(*real_calloc)(size_t n, size_t size);
+static void *(*real_realloc)(void *ptr, size_t size);
+static void (*real_free)(void *ptr);
+static int (*real_posix_memalign)(void **memptr, size_t align, size_t size);
+static void *(*real_aligned_alloc)(size_t align, size_t size);
+static void *(*real_memalign)(size_t align, size_t size);
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool in_recorder;   // calls made by the recorder itself
+static int out_fd = -1;
+static bool resolving;
+
+static char out_buf[OUT_BUFFER];
+static size_t out_len;
+
+/* live pointer -> id,linear probing */
+static entry_t *table;
+static size_t table_cap, table_used;
+
+/* ids free for reuse,and the next fresh one */
+static size_t *free_ids;
+static size_t free_ids_cap, free_ids_len, next_id;
+
+static char boot_heap[BOOT_HEAP];
+static size_t boot_used;
+
+static void resolve(void);
+static void record(char type, void *ptr, void *old, size_t size);
+static size_t take_id(void);
+static void table_insert(void *ptr, size_t id);
+static bool table_remove(void *ptr, size_t *id);
+static void table_grow(void);
+static size_t table_slot(void *ptr, size_t cap);
+static void *grow_array(void *old, size_t old_bytes, size_t new_bytes);
+static void put_varint(size_t value);
+static void flush_out(void);
+static void recorder_exit(void);
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+static bool from_boot(void *ptr);
+
+void *malloc(size_t size){
+
+    void *ptr;
+
+    resolve();
+    if (resolving){
+        // dlsym allocates before real_malloc is known
+        size = (size + 15) & ~(size_t)15;
+        if (boot_used + size > BOOT_HEAP){
+            return NULL;
+        }
+        ptr = boot_heap + boot_used;
+        boot_used += size;
+        return ptr;
+    }
+    pthread_mutex_lock(&record_lock);
+    ptr = real_malloc(size);
+    record('a', ptr, NULL, size);
+    pthread_mutex_unlock(&record_lock);
+    return ptr;
+}
+
+void *calloc(size_t n, size_t size){
+
+    void *ptr;
+
+    resolve();
+    if (resolving){
+        // boot_heap is zero and never reused
+        return n && size > SIZE_MAX / n ? NULL : malloc(n * size);
+    }
+    pthread_mutex_lock(&record_lock);
+    ptr = real_calloc(n, size);
+    record('a', ptr, NULL, n * size);
+    pthread_mutex_unlock(&record_lock);
+    return ptr;
+}
+
+void *realloc(void *old, size_t size){
+
+    void *ptr;
+    size_t copy;
+
+    resolve();
+    if (from_boot(old)){
+        copy = boot_heap + BOOT_HEAP - (char *)old;
+        if ((ptr = malloc(size)) != NULL){
+            memcpy(ptr, old, size < copy ? size : copy);
+        }
+        return ptr;
+    }
+    pthread_mutex_lock(&record_lock);
+    ptr = real_realloc(old, size);
+    if (old == NULL){
+        record('a', ptr, NULL, size);
+    }else if (size == 0){
+        record('f', NULL, old, 0);
+    }else{
+        record('r', ptr, old, size);
+    }
+    pthread_mutex_unlock(&record_lock);
+    return ptr;
+}
+
+void free(void *ptr){
+
+    if (ptr == NULL || from_boot(ptr)){
+        return;
+    }
+    resolve();
+    pthread_mutex_lock(&record_lock);
+    real_free(ptr);
+    record('f', NULL, ptr, 0);
+    pthread_mutex_unlock(&record_lock);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size){
+
+    int ret;
+
+    resolve();
+    pthread_mutex_lock(&record_lock);
+    ret = real_posix_memalign(memptr, align, size);
+    if (ret == 0){
+        record('a', *memptr, NULL, size);
+    }
+    pthread_mutex_unlock(&record_lock);
+    return ret;
+}
+
+void *aligned_alloc(size_t align, size_t size){
+
+    void *ptr;
+
+    resolve();
+    pthread_mutex_lock(&record_lock);
+    ptr = real_aligned_alloc(align, size);
+    record('a', ptr, NULL, size);
+    pthread_mutex_unlock(&record_lock);
+    return ptr;
+}
+
+void *memalign(size_t align, size_t size){
+
+    void *ptr;
+
+    resolve();
+    pthread_mutex_lock(&record_lock);
+    ptr = real_memalign(align, size);
+    record('a', ptr, NULL, size);
+    pthread_mutex_unlock(&record_lock);
+    return ptr;
+}
+
+/*
+ * resolve: look up the next allocator and open the trace on first use
+ */
+static void resolve(void){
+
+    const char *path;
+
+    if (real_malloc || resolving){
+        return;
+    }
+    resolving = true;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    resolving = false;
+
+    if ((path = getenv("MM_RECORD")) == NULL){
+        path = "mm-trace.bin";
+    }
+    out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd < 0){
+        perror(path);
+        return;
+    }
+    memcpy(out_buf, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+    out_len = sizeof(TRACE_MAGIC) - 1;
+    atexit(recorder_exit);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/*
+ * record: log one call,caller holds record_lock
+ *
+ * ptr is the new block (null if the call failed),old the block given up;
+ * calls on pointers the recorder never saw are dropped
+ */
+static void record(char type, void *ptr, void *old, size_t size){
+
+    size_t id;
+
+    if (in_recorder || out_fd < 0){
+        return;
+    }
+    in_recorder = true;
+
+    switch (type){
+    case 'a':
+        if (ptr == NULL){
+            break;
+        }
+        id = take_id();
+        table_insert(ptr, id);
+        out_buf[out_len++] = 'a';
+        put_varint(id);
+        put_varint(size);
+        break;
+    case 'r':
+        if (ptr == NULL){
+            break;
+        }
+        if (!table_remove(old, &id)){
+            // resized a block from before recording: log it as new
+            id = take_id();
+            table_insert(ptr, id);
+            out_buf[out_len++] = 'a';
+            put_varint(id);
+            put_varint(size);
+            break;
+        }
+        table_insert(ptr, id);
+        out_buf[out_len++] = 'r';
+        put_varint(id);
+        put_varint(size);
+        break;
+    default:
+        if (!table_remove(old, &id)){
+            break;
+        }
+        if (free_ids_len == free_ids_cap){
+            free_ids = grow_array(free_ids, free_ids_cap * sizeof(size_t),
+                                  (free_ids_cap ? 2 * free_ids_cap : 4096)
+                                  * sizeof(size_t));
+            free_ids_cap = free_ids_cap ? 2 * free_ids_cap : 4096;
+        }
+        free_ids[free_ids_len++] = id;
+        out_buf[out_len++] = 'f';
+        put_varint(id);
+        break;
+    }
+
+    if (out_len > OUT_BUFFER - 32){
+        flush_out();
+    }
+    in_recorder = false;
+}
+
+static size_t take_id(void){
+
+    if (free_ids_len > 0){
+        return free_ids[--free_ids_len];
+    }
+    return next_id++;
+}
+
+static void table_insert(void *ptr, size_t id){
+
+    size_t i;
+
+    if (2 * (table_used + 1) > table_cap){
+        table_grow();
+    }
+    for (i = table_slot(ptr, table_cap); table[i].ptr;
+         i = (i + 1) & (table_cap - 1));
+    table[i].ptr = ptr;
+    table[i].id = id;
+    table_used++;
+}
+
+/*
+ * table_remove: drop ptr from the table and return its id,
+ *               shifting later entries back so no tombstones are needed
+ */
+static bool table_remove(void *ptr, size_t *id){
+
+    size_t i, j, home;
+
+    if (table_cap == 0){
+        return false;
+    }
+    for (i = table_slot(ptr, table_cap); table[i].ptr != ptr;
+         i = (i + 1) & (table_cap - 1)){
+        if (table[i].ptr == NULL){
+            return false;
+        }
+    }
+    *id = table[i].id;
+    table_used--;
+
+    for (j = (i + 1) & (table_cap - 1); table[j].ptr;
+         j = (j + 1) & (table_cap - 1)){
+        home = table_slot(table[j].ptr, table_cap);
+        // move j into the hole at i unless its home lies in (i,j]
+        if (((j - home) & (table_cap - 1)) >= ((j - i) & (table_cap - 1))){
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].ptr = NULL;
+    return true;
+}
+
+static void table_grow(void){
+
+    size_t i, j, cap = table_cap ? 2 * table_cap : 1 << 16;
+    entry_t *old = table;
+    entry_t *grown = grow_array(NULL, 0, cap * sizeof(entry_t));
+
+    for (i = 0; i < table_cap; i++){
+        if (old[i].ptr){
+            for (j = table_slot(old[i].ptr, cap); grown[j].ptr;
+                 j = (j + 1) & (cap - 1));
+            grown[j] = old[i];
+        }
+    }
+    if (old){
+        munmap(old, table_cap * sizeof(entry_t));
+    }
+    table = grown;
+    table_cap = cap;
+}
+
+static size_t table_slot(void *ptr, size_t cap){
+
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 20)
+           & (cap - 1);
+}
+
+/*
+ * grow_array: mmap'd copy of old with room for new_bytes,old is unmapped
+ */
+static void *grow_array(void *old, size_t old_bytes, size_t new_bytes){
+
+    void *mem = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED){
+        abort();
+    }
+    if (old){
+        memcpy(mem, old, old_bytes);
+        munmap(old, old_bytes);
+    }
+    return mem;
+}
+
+static void put_varint(size_t value){
+
+    while (value >= 0x80){
+        out_buf[out_len++] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out_buf[out_len++] = (char)value;
+}
+
+static void flush_out(void){
+
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < out_len){
+        if ((n = write(out_fd, out_buf + done, out_len - done)) <= 0){
+            break;
+        }
+        done += n;
+    }
+    out_len = 0;
+}
+
+static void recorder_exit(void){
+
+    pthread_mutex_lock(&record_lock);
+    if (out_fd >= 0){
+        flush_out();
+        close(out_fd);
+        out_fd = -1;
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+/*
+ * fork handlers: no call is half-logged across fork,and the child
+ *                stops recording so the parent's trace stays intact
+ */
+static void fork_prepare(void){
+
+    pthread_mutex_lock(&record_lock);
+}
+
+static void fork_parent(void){
+
+    pthread_mutex_unlock(&record_lock);
+}
+
+static void fork_child(void){
+
+    pthread_mutex_init(&record_lock, NULL);
+    if (out_fd >= 0){
+        close(out_fd);
+        out_fd = -1;
+    }
+    out_len = 0;
+}
+
+static bool from_boot(void *ptr){
+
+    return (char *)ptr >= boot_heap && (char *)ptr < boot_heap + BOOT_HEAP;
+}
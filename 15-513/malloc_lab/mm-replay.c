@@ -0,0 +1,441 @@
+/*
+ * mm-replay.c: replay allocation traces against mm.c and time every call
+ *
+ * build next to the lab's memlib.c:
+ *   gcc -O2 -DDRIVER -o mm-replay mm-replay.c mm.c memlib.c
+ * a variant allocator is compared by building the same file against
+ * its mm.c,the system malloc by running with -s
+ *
+ * usage: mm-replay [-s] [-t N] [-w out] <trace>...
+ *   -s       replay against the system malloc instead of mm.c
+ *   -t N     print heap utilization and fragmentation every N requests
+ *   -w out   write the (single) trace in binary form to out and exit
+ *
+ * traces come in two formats,told apart by their first bytes:
+ * text,the lab format:a few header numbers,then one request per line
+ *   a <id> <bytes>   allocate
+ *   r <id> <bytes>   reallocate
+ *   f <id>           free
+ * binary,as written by mm-record.so or -w:the 8 bytes "MMTRACE1",then
+ * per request the letter a/r/f,the id and (except for f) the size,
+ * both as LEB128 varints
+ *
+ * every trace is replayed twice on a fresh heap:once untimed per call for
+ * throughput,once with each call timed for the latency percentiles.
+ * the second run also tracks the live payload,so for mm.c the peak
+ * utilization (peak payload / peak heap+mapped bytes) can be reported
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm-ext.h"
+
+#define TRACE_MAGIC "MMTRACE1"
+
+typedef struct {
+    char type;          // 'a', 'r' or 'f'
+    size_t id;
+    size_t size;
+} request_t;
+
+typedef struct {
+    request_t *ops;
+    size_t num_ops;
+    size_t num_ids;
+} trace_t;
+
+typedef void *(*malloc_fn)(size_t size);
+typedef void *(*realloc_fn)(void *ptr, size_t size);
+typedef void (*free_fn)(void *ptr);
+
+/* allocator under test */
+static malloc_fn replay_malloc = mm_malloc;
+static realloc_fn replay_realloc = mm_realloc;
+static free_fn replay_free = mm_free;
+static bool use_system = false;
+
+/* command line options */
+static size_t timeline = 0;
+
+static bool read_trace(const char *path, trace_t *trace);
+static bool read_text(FILE *fp, trace_t *trace);
+static bool read_binary(FILE *fp, trace_t *trace);
+static bool read_varint(FILE *fp, size_t *value);
+static void add_request(trace_t *trace, request_t *req, size_t *cap);
+static bool write_binary(const char *path, trace_t *trace);
+static void write_varint(FILE *fp, size_t value);
+static void replay(const char *path, trace_t *trace);
+static void reset_heap(void);
+static int cmp_u32(const void *a, const void *b);
+static uint32_t percentile(uint32_t *sorted, size_t n, double p);
+static uint64_t now_ns(void);
+
+int main(int argc, char **argv){
+
+    int c, i;
+    trace_t trace;
+    const char *out = NULL;
+
+    while ((c = getopt(argc, argv, "st:w:")) != -1){
+        switch (c){
+        case 's':
+            replay_malloc = malloc;
+            replay_realloc = realloc;
+            replay_free = free;
+            use_system = true;
+            break;
+        case 't':
+            timeline = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            out = optarg;
+            break;
+        default:
+            exit(1);
+        }
+    }
+    if (optind >= argc){
+        fprintf(stderr, "usage: %s [-s] [-t N] [-w out] <trace>...\n",
+                argv[0]);
+        exit(1);
+    }
+
+    if (out){
+        if (!read_trace(argv[optind], &trace)
+                || !write_binary(out, &trace)){
+            exit(1);
+        }
+        return 0;
+    }
+
+    mem_init();
+    printf("%-28s %9s %9s %8s %8s %8s %9s %7s\n", "trace", "requests",
+           "Mops/sec", "p50 ns", "p99 ns", "p99.9 ns", "max ns", "util");
+    for (i = optind; i < argc; i++){
+        if (!read_trace(argv[i], &trace)){
+            exit(1);
+        }
+        replay(argv[i], &trace);
+        free(trace.ops);
+    }
+    return 0;
+}
+
+/*
+ * read_trace: load every request of a text or binary trace into memory
+ *             ids size the pointer table
+ */
+static bool read_trace(const char *path, trace_t *trace){
+
+    FILE *fp;
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    bool ok;
+
+    if ((fp = fopen(path, "r")) == NULL){
+        perror(path);
+        return false;
+    }
+
+    trace->ops = NULL;
+    trace->num_ops = 0;
+    trace->num_ids = 0;
+
+    if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+            && !memcmp(magic, TRACE_MAGIC, sizeof(magic))){
+        ok = read_binary(fp, trace);
+    }else{
+        rewind(fp);
+        ok = read_text(fp, trace);
+    }
+    fclose(fp);
+    if (!ok){
+        fprintf(stderr, "%s: malformed trace\n", path);
+    }
+    return ok;
+}
+
+/*
+ * read_text: lab format,numeric header lines are skipped
+ */
+static bool read_text(FILE *fp, trace_t *trace){
+
+    char line[256];
+    char *p;
+    size_t cap = 0;
+    request_t req;
+
+    while (fgets(line, sizeof(line), fp)){
+        for (p = line; isspace((unsigned char)*p); p++);
+        req.size = 0;
+        if (*p == 'a' || *p == 'r'){
+            if (sscanf(p + 1, "%zu %zu", &req.id, &req.size) != 2){
+                continue;
+            }
+        }else if (*p == 'f'){
+            if (sscanf(p + 1, "%zu", &req.id) != 1){
+                continue;
+            }
+        }else{
+            continue;
+        }
+        req.type = *p;
+        add_request(trace, &req, &cap);
+    }
+    return true;
+}
+
+/*
+ * read_binary: records after the magic,up to the end of the file
+ */
+static bool read_binary(FILE *fp, trace_t *trace){
+
+    int type;
+    size_t cap = 0;
+    request_t req;
+
+    while ((type = getc(fp)) != EOF){
+        if (type != 'a' && type != 'r' && type != 'f'){
+            return false;
+        }
+        req.type = type;
+        req.size = 0;
+        if (!read_varint(fp, &req.id)){
+            return false;
+        }
+        if (type != 'f' && !read_varint(fp, &req.size)){
+            return false;
+        }
+        add_request(trace, &req, &cap);
+    }
+    return true;
+}
+
+static bool read_varint(FILE *fp, size_t *value){
+
+    int c, shift = 0;
+
+    *value = 0;
+    do {
+        if ((c = getc(fp)) == EOF || shift > 63){
+            return false;
+        }
+        *value |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return true;
+}
+
+static void add_request(trace_t *trace, request_t *req, size_t *cap){
+
+    if (trace->num_ops == *cap){
+        *cap = *cap ? 2 * *cap : 1024;
+        trace->ops = realloc(trace->ops, *cap * sizeof(request_t));
+    }
+    trace->ops[trace->num_ops++] = *req;
+    if (req->id >= trace->num_ids){
+        trace->num_ids = req->id + 1;
+    }
+}
+
+/*
+ * write_binary: store trace in the binary format
+ */
+static bool write_binary(const char *path, trace_t *trace){
+
+    FILE *fp;
+    size_t i;
+    request_t *req;
+
+    if ((fp = fopen(path, "w")) == NULL){
+        perror(path);
+        return false;
+    }
+    fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, fp);
+    for (i = 0; i < trace->num_ops; i++){
+        req = &trace->ops[i];
+        putc(req->type, fp);
+        write_varint(fp, req->id);
+        if (req->type != 'f'){
+            write_varint(fp, req->size);
+        }
+    }
+    if (fclose(fp) != 0){
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+static void write_varint(FILE *fp, size_t value){
+
+    while (value >= 0x80){
+        putc((int)(value & 0x7f) | 0x80, fp);
+        value >>= 7;
+    }
+    putc((int)value, fp);
+}
+
+/*
+ * replay: run one trace twice and print its throughput,latency
+ *         percentiles and (for mm.c) peak utilization
+ */
+static void replay(const char *path, trace_t *trace){
+
+    size_t i;
+    uint64_t start, elapsed;
+    uint64_t live = 0, peak_live = 0;
+    size_t footprint, peak_footprint = 0;
+    double seconds;
+    request_t *req;
+    mm_stats_t st;
+    void **ptrs = calloc(trace->num_ids, sizeof(void *));
+    size_t *sizes = calloc(trace->num_ids, sizeof(size_t));
+    uint32_t *lat = malloc(trace->num_ops * sizeof(uint32_t) + 1);
+
+    // throughput: the whole trace timed at once
+    reset_heap();
+    start = now_ns();
+    for (i = 0; i < trace->num_ops; i++){
+        req = &trace->ops[i];
+        switch (req->type){
+        case 'a':
+            ptrs[req->id] = replay_malloc(req->size);
+            break;
+        case 'r':
+            ptrs[req->id] = replay_realloc(ptrs[req->id], req->size);
+            break;
+        default:
+            replay_free(ptrs[req->id]);
+            ptrs[req->id] = NULL;
+            break;
+        }
+    }
+    seconds = (now_ns() - start) * 1e-9;
+    for (i = 0; i < trace->num_ids; i++){
+        replay_free(ptrs[i]);
+        ptrs[i] = NULL;
+    }
+
+    // latency and utilization: every call timed on its own
+    reset_heap();
+    if (timeline && !use_system){
+        printf("  %10s %12s %12s %7s %7s\n", "request", "payload",
+               "footprint", "util", "frag");
+    }
+    for (i = 0; i < trace->num_ops; i++){
+        req = &trace->ops[i];
+        switch (req->type){
+        case 'a':
+            start = now_ns();
+            ptrs[req->id] = replay_malloc(req->size);
+            elapsed = now_ns() - start;
+            live += req->size;
+            sizes[req->id] = req->size;
+            break;
+        case 'r':
+            start = now_ns();
+            ptrs[req->id] = replay_realloc(ptrs[req->id], req->size);
+            elapsed = now_ns() - start;
+            live += req->size - sizes[req->id];
+            sizes[req->id] = req->size;
+            break;
+        default:
+            start = now_ns();
+            replay_free(ptrs[req->id]);
+            elapsed = now_ns() - start;
+            ptrs[req->id] = NULL;
+            live -= sizes[req->id];
+            sizes[req->id] = 0;
+            break;
+        }
+        lat[i] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+        if (live > peak_live){
+            peak_live = live;
+        }
+
+        if (use_system){
+            continue;
+        }
+        mm_stats(&st);
+        footprint = st.heap_size + st.mapped;
+        if (footprint > peak_footprint){
+            peak_footprint = footprint;
+        }
+        if (timeline && (i + 1) % timeline == 0){
+            printf("  %10zu %12lu %12zu %6.1f%% %7.3f\n", i + 1,
+                   (unsigned long)live, footprint,
+                   footprint ? 100.0 * live / footprint : 0.0,
+                   st.fragmentation);
+        }
+    }
+    for (i = 0; i < trace->num_ids; i++){
+        replay_free(ptrs[i]);
+    }
+
+    qsort(lat, trace->num_ops, sizeof(uint32_t), cmp_u32);
+    printf("%-28s %9zu %9.2f %8u %8u %8u %9u ", path, trace->num_ops,
+           seconds > 0 ? trace->num_ops / seconds * 1e-6 : 0.0,
+           percentile(lat, trace->num_ops, 0.50),
+           percentile(lat, trace->num_ops, 0.99),
+           percentile(lat, trace->num_ops, 0.999),
+           trace->num_ops ? lat[trace->num_ops - 1] : 0);
+    if (use_system || peak_footprint == 0){
+        printf("%7s\n", "-");
+    }else{
+        printf("%6.1f%%\n", 100.0 * peak_live / peak_footprint);
+    }
+
+    free(ptrs);
+    free(sizes);
+    free(lat);
+}
+
+/*
+ * reset_heap: start mm.c on an empty heap,nothing to do for the system
+ */
+static void reset_heap(void){
+
+    if (use_system){
+        return;
+    }
+    mem_reset_brk();
+    if (!mm_init()){
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+}
+
+static int cmp_u32(const void *a, const void *b){
+
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * percentile: value below which a fraction p of the sorted samples fall
+ */
+static uint32_t percentile(uint32_t *sorted, size_t n, double p){
+
+    if (n == 0){
+        return 0;
+    }
+    return sorted[(size_t)(p * (n - 1))];
+}
+
+static uint64_t now_ns(void){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -5,29 +5,138 @@
  *
  ******************************************************************************
  *                               mm.c                                         *
- *           64-bit struct-based segregated free list memory allocator        *
+ *           64-bit struct-based two-level segregated fit allocator           *
  *                  15-213: Introduction to Computer Systems                  *
  *                                                                            *
  *  ************************************************************************  *
  * 
  * mm.c: a malloc simulator,which also support calloc method
  *  
- * the allocator uses segregated free lists with LIFO policy to hold the blocks 
- * there are 16 segregated lists which are associated with distinct size ranges
- * the min block size is 2*wsize(or dsize),and the chunk size is 2**8 bytes
+ * the allocator uses segregated free lists with LIFO policy to hold the blocks,
+ * indexed two-level (TLSF style):the first level splits sizes by power of two,
+ * the second level splits each power of two into SL_COUNT equal ranges.
+ * one bitmap marks non-empty first-level classes and one per class marks
+ * non-empty lists,so find_fit is two find-first-set operations:a list whose
+ * smallest size is at least the rounded-up request always fits.
+ * free blocks of tree_min bytes and up skip the lists:they are nodes of a
+ * red-black tree ordered by size then address,linked through their payload,
+ * so large requests get the best fit in O(log n) and ties go to the lowest
+ * address,which keeps large free space packed toward the start of the heap
+ * the min block size is 2*dsize,so every free block has room for its header,
+ * next/prev pointers and footer;the chunk size is 2**9 bytes
  * heap consists of Prologue footer and Epilogue header,with 2*wsize empty space
  *
+ * compact mode (compile with -DMM_COMPACT) makes headers and footers 4 bytes
+ * and stores next/prev as 4-byte offsets from heap_start,so the min block is
+ * 16 bytes and a block carries 4 bytes of overhead instead of 8.the heap and
+ * every block (mapped ones included) then stay below 4 GiB,block_max;
+ * payloads are still 16-byte aligned,headers sit 4 bytes before them
+ *
  * the header/footer for the blocks can be seen as follow:
  *
- *      header:  |block size|third bit|second bit|alloc bit|
- *      footer:  |            block size               |a/f|
+ *      header:  |block size|fourth bit|third bit|second bit|alloc bit|
+ *      footer:  |            block size                          |a/f|
+ *
+ * free list links go through get/set_next_free and get/set_prev_free only,
+ * a link_t is a block pointer or,in compact mode,an offset (link_null: none)
  *
  * the info can be described as:
- * 1:third bit:to indicate if size is appropriate
- * 2:second bit: to indicate if previous block is allocated
- * 3:alloc bit: to indicate if current block is allocated
+ * 1:fourth bit: free block whose inner pages were given back to the OS;
+ *              allocated block of a batch that mm_free_batch is freeing;
+ *              in hardened mode,allocated block on a quick list;
+ *              mapped block that the profiler sampled (with the third bit,
+ *              so mm_free_batch never takes it for one of its own marks)
+ * 2:third bit: allocated block that lives in its own mapping;
+ *              free block whose bytes are all zero apart from its header,
+ *              next/prev pointers and footer (fresh from the OS)
+ * 3:second bit: to indicate if previous block is allocated
+ * 4:alloc bit: to indicate if current block is allocated
  * note that we don't need to write the footer for an allocated block
  *
+ * requests of at least mmap_threshold bytes get a private mapping each,
+ * which free() unmaps,so a transient buffer does not grow the heap for good.
+ * the heap itself never shrinks,but free blocks of at least trim_threshold
+ * bytes hand their inner pages back with madvise(MADV_DONTNEED);
+ * both thresholds can be changed with mm_mallopt()
+ *
+ * calloc only clears what it has to:a mapped block is zero already,and a
+ * block placed from a known-zero free block only needs the words that held
+ * its list pointers and footer cleared.known-zero blocks come from heap
+ * extension and stay known-zero through splitting and through coalescing
+ * with other known-zero blocks
+ *
+ * memalign/posix_memalign/aligned_alloc place the payload of a regular
+ * block on the requested power-of-two boundary;the gap in front of it
+ * goes back to the free lists as a free block of its own
+ *
+ * mm_stats()/mm_stats_print() report counters that the allocation paths
+ * keep up to date as they go:free bytes per power-of-two class are kept
+ * by insert_list/remove_list,so nothing has to walk the heap
+ *
+ * freeing a block of up to quick_max bytes does not coalesce it yet:it
+ * goes on a LIFO quick list of its exact size,still marked allocated,and
+ * the next malloc of that size takes it back without a search or split.
+ * a quick list longer than QUICK_MAX is freed for real as a batch,and
+ * all of them are when find_fit comes up empty
+ *
+ * mm_malloc_batch/mm_free_batch serve n objects under one lock:a batch of
+ * one regular size is carved back to back from a single free block,and
+ * neighbouring blocks of a freed batch are merged before coalescing
+ *
+ * arenas (mm_arena_* in mm-ext.h) hand out memory by bumping a pointer
+ * through chunks that are ordinary allocated blocks of the heap;the newest
+ * chunk grows in place while the heap behind it is free,so an arena is
+ * often a single block and reset/destroy frees it with one coalesce
+ *
+ * requests up to slab_max bytes are served from slabs instead:a slab is a
+ * page-aligned, page-sized allocated block carved into fixed-size slots of
+ * one size class,with a free bitmap in the slab header and no per-slot header.
+ * slab_map marks the heap pages that hold a slab,so free() finds the slab of
+ * a pointer by rounding it down to its page in O(1)
+ *
+ * built without -DDRIVER,slabs come out of segments:2 MiB blocks aligned
+ * to 2 MiB whose first page is a header with a bitmap of the free pages.
+ * the slabs then share a few huge pages (see memlib-os.c) instead of being
+ * scattered over the heap one page at a time,which keeps the dTLB misses of
+ * small objects down;a segment goes back to the heap once all its slabs
+ * are empty,unless it is the only one with free pages
+ *
+ * thread-safe mode (compile with -DMM_THREADS, link with -lpthread):
+ * every thread owns a slab heap,segments and slabs of its own that only
+ * it allocates from,and serves small malloc/free calls from it without
+ * locking through a small LIFO cache of free slots per size class;
+ * cached slots still look allocated to their slab.a slot freed by another
+ * thread is pushed on the remote free list of its owner with one
+ * compare-and-swap,and the owner takes the whole list back when its cache
+ * runs dry.heap_lock guards all shared heap state,which a thread heap
+ * only needs to carve a new segment (or slab) or give an empty one back;
+ * the owner changes its heap under a lock of the heap's own,which nothing
+ * else takes but fork(),and always before heap_lock.the heap of a thread
+ * that exited is adopted by the next one that needs one
+ *
+ * built without -DDRIVER (see memlib-os.c) mm.c is a drop-in malloc for
+ * LD_PRELOAD:memlib-os.c backs mem_sbrk with reserved address space and,
+ * with MM_THREADS,heap_lock is taken around fork() so the child never
+ * inherits it locked
+ *
+ * hardened mode (compile with -DMM_HARDENED) is cheap enough to leave on
+ * outside the driver:the last word of every allocated block is a canary
+ * tied to its address and size,checked when the block is freed or resized;
+ * every unlink checks the links around the block;and each malloc/free-type
+ * call runs check_block on the next CHECK_STEP blocks of the heap,so a heap
+ * of n blocks is verified every n calls or so.a failed check prints the
+ * block and the call that found it and aborts
+ *
+ * the sampling profiler (mm_mallopt(MM_OPT_PROF_SAMPLE),mm_prof_dump())
+ * counts down the bytes malloc and calloc hand out;when the count runs out
+ * the request is sampled and the count restarts from a draw of an
+ * exponential distribution with mean prof_rate,so every byte is as likely
+ * to be sampled.a sampled request gets a mapping of its own,marked with
+ * the fourth bit,and its stack goes into a table kept apart from the heap;
+ * free() then only reaches the profiler through mmap_free,and the calls
+ * that are not sampled pay one subtract and branch.the profile holds the
+ * live samples per stack in the text format pprof reads as heap_v2
+ *
  * reference:mm-baseline.c
  ******************************************************************************
  */
@@ -57,6 +166,28 @@
 
 /* You can change anything from here onward */
 
+#ifdef DRIVER
+/* aligned allocation follows the same naming */
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define memalign mm_memalign
+#define malloc_usable_size mm_malloc_usable_size
+#define free_sized mm_free_sized
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
+
+#include "mm-ext.h"
+
 /*
  * If DEBUG is defined, enable printing on dbg_printf and contracts.
  * Debugging macros, with names beginning "dbg_" are allowed.
@@ -82,18 +213,85 @@
 #define dbg_checkheap(...)
 #endif
 
-#define NUM_LIST 16
+#define SL_LOG2 3                  // second-level lists per power of two
+#define SL_COUNT (1 << SL_LOG2)
+#define FL_SHIFT 7                 // sizes below 2**FL_SHIFT share level 0
+#define FL_COUNT (64 - FL_SHIFT + 1)
+
+#define SLAB_CLASSES 16      // slot sizes: 16,32,...,256 bytes
+#define SLAB_MAP_PAGES (1 << 20)   // slab_map covers the first 4 GiB of heap
+#define SEGMENT_PAGES 512          // slab pages per segment,header included
+
+#define QUICK_CLASSES 64     // block sizes: min_block_size and 63 more
+#define QUICK_MAX 32         // blocks per quick list before it is flushed
+
+#define CHECK_STEP 1         // blocks verified per call in hardened mode
+
+#define PROF_DEPTH 32        // frames kept per sampled stack
+#define PROF_BUCKETS 4096    // hash heads of the stack table
+#define PROF_PAGES 64        // one-page sample mappings kept after free
+
+#ifdef MM_THREADS
+#define MM_TLS __thread     // one per thread,for the profiler's countdown
+#define TCACHE_CLASSES SLAB_CLASSES
+#define TCACHE_BATCH 16     // blocks moved per refill/drain
+#define TCACHE_MAX 64       // cached blocks per class before draining
+#else
+#define MM_TLS
+#endif
 
 /* Basic constants */
+#ifdef MM_COMPACT
+typedef uint32_t word_t;
+#else
 typedef uint64_t word_t;
+#endif
 static const size_t wsize = sizeof(word_t);   // word and header size (bytes)
 static const size_t dsize = 2*wsize;          // double word size (bytes)
-static const size_t min_block_size = dsize;   // Minimum block size
+static const size_t min_block_size = 2*dsize; // Minimum block size
 static const size_t chunksize = (1 << 9);     // requires (chunksize % 16 == 0)
 
+static const size_t page_size = (1 << 12);
+static const size_t slab_size = (1 << 12);    // one page per slab
+static const size_t slab_max = 256;           // largest size served by slabs
+static const size_t slab_page_shift = 12;     // log2(slab_size)
+static const size_t segment_size = SEGMENT_PAGES*(1 << 12); // one huge page
+static const size_t quick_max = min_block_size + (QUICK_CLASSES-1)*16;
+static const size_t tree_min = (1 << 12);     // free blocks kept in the tree
+
+static const size_t arena_chunk_default = (1 << 16); // payload of a new chunk
+
+static const size_t prof_idle = (1 << 26);    // countdown while sampling is off
+static const size_t prof_max = (size_t)1 << 40; // countdowns stay below this
+static const size_t prof_rate_max = (size_t)1 << 32;
+static const size_t prof_pool_size = (1 << 16); // profiler memory per mapping
+
+#ifdef MM_HARDENED
+static const bool hardened = true;
+static const size_t canary_size = sizeof(word_t); // ends every allocated block
+#else
+static const bool hardened = false;
+static const size_t canary_size = 0;
+#endif
+
+#ifdef MM_COMPACT
+static const size_t block_max = ((size_t)1 << 32) - 16; // sizes fit a header
+#else
+static const size_t block_max = SIZE_MAX;
+#endif
+
+#ifdef DRIVER
+static const bool sbrk_zeroed = false;  // the driver reuses its heap per trace
+static const bool slab_segments = false; // 2 MiB at once would sink utilization
+#else
+static const bool sbrk_zeroed = true;   // new heap pages come zeroed from the OS
+static const bool slab_segments = true; // slabs packed into huge pages
+#endif
+
 static const word_t alloc_mask = 0x1;
 static const word_t second_bit_mask = 0x2;
 static const word_t third_bit_mask = 0x4;
+static const word_t fourth_bit_mask = 0x8;
 static const word_t size_mask = ~(word_t)0xF;
 
 typedef struct block
@@ -112,17 +310,223 @@ typedef struct block
      */
 } block_t;
 
+#ifdef MM_COMPACT
+typedef uint32_t link_t;        // offset of a free block from heap_start
+static const link_t link_null = UINT32_MAX; // never a multiple of 16
+#else
+typedef block_t *link_t;
+#endif
+
+typedef struct slab
+{
+    struct slab *next;      // partial list of this size class
+    struct slab *prev;
+    struct slab_heap *heap; // owner,see slab_heap_t
+    uint32_t index;         // size class,slot size is (index+1)*16
+    uint32_t nfree;         // free slots left
+    uint32_t nslots;
+    uint32_t in_segment;    // page of a segment rather than a block of its own
+    uint64_t bitmap[4];     // bit set: slot is free
+    /*
+     * slots start right after the header,which is padded to keep them
+     * 16-byte aligned
+     */
+    char slots[0] __attribute__((aligned(16)));
+} slab_t;
+
+typedef struct segment
+{
+    struct segment *next;   // segments that still have free pages
+    struct segment *prev;
+    struct slab_heap *heap; // owner of the segment and its slabs
+    uint32_t nfree;         // free slab pages left
+    uint32_t pad;
+    uint64_t free_map[SEGMENT_PAGES/64];   // bit set: page is free
+    /*
+     * page 0 is this header,pages 1 to SEGMENT_PAGES-1 hold slabs
+     */
+} segment_t;
+
+/*
+ * the slabs and segments of one owner:shared_slabs,used under heap_lock,
+ * or a thread that allocates from them without locking
+ */
+typedef struct slab_heap
+{
+    slab_t *partial[SLAB_CLASSES];  // slabs with free slots,per class
+    segment_t *segments;            // segments with free pages
+    struct slab_heap *next;         // every thread heap,for adoption
+    bool abandoned;                 // its thread exited
+#ifdef MM_THREADS
+    pthread_mutex_t lock;           // held by the owner while it changes
+                                    // the heap,so fork() can wait for it
+#endif
+    /*
+     * slots other threads freed,linked through their payload;pushed with
+     * compare-and-swap and taken all at once by the owner,on a cache line
+     * of its own so the pushes leave the owner's fields alone
+     */
+    void *remote __attribute__((aligned(64)));
+} slab_heap_t;
+
+typedef struct arena_chunk
+{
+    struct arena_chunk *next;   // older chunks of the same arena
+    char *end;                  // end of the chunk's payload
+    /*
+     * the bump area follows,16-byte aligned like every payload
+     */
+    char data[0];
+} arena_chunk_t;
+
+/* links of a free block in the size tree,in place of next/prev */
+typedef struct tree_node
+{
+    block_t *child[2];      // smaller and larger (size,address)
+    block_t *parent;
+    word_t red;
+} tree_node_t;
+
+/* sampled allocations of one stack */
+typedef struct prof_bucket
+{
+    struct prof_bucket *next;   // same hash head
+    uint64_t live_count;        // samples not freed yet
+    uint64_t live_bytes;
+    uint64_t alloc_count;       // every sample taken here
+    uint64_t alloc_bytes;
+    uint32_t hash;
+    uint32_t depth;
+    void *stack[PROF_DEPTH];    // return addresses,innermost first
+} prof_bucket_t;
+
+/* one live sample,pointed to from the front of its mapping */
+typedef struct prof_sample
+{
+    prof_bucket_t *bucket;
+    size_t size;                // bytes asked for
+    struct prof_sample *next;   // free samples
+} prof_sample_t;
+
+struct mm_arena
+{
+    arena_chunk_t *chunks;      // newest first,allocation bumps in the head
+    char *cur;                  // next free byte of the head chunk
+    size_t chunk_size;          // least payload of a new chunk
+};
+
 
 /* Global variables */
 /* Pointer to first block */
 static block_t *heap_start = NULL;
 
-/* initialize new segregated free list */
-static block_t *segregated_list[NUM_LIST];
+/* segregated free lists,indexed by first and second level class */
+static block_t *free_lists[FL_COUNT][SL_COUNT];
+static uint64_t fl_bitmap;              // bit fl set: sl_bitmap[fl] != 0
+static uint32_t sl_bitmap[FL_COUNT];    // bit sl set: free_lists[fl][sl] used
+
+/* free blocks of at least tree_min bytes,red-black by (size,address) */
+static block_t *tree_root;
+
+/* slabs and segments served under heap_lock (all of them without threads) */
+static slab_heap_t shared_slabs;
+
+/* heaps of threads,live and abandoned,listed under heap_lock */
+static slab_heap_t *thread_heaps;
+
+/* one bit per heap page,set when the page holds a slab */
+static uint64_t slab_map[SLAB_MAP_PAGES/64];
+static uintptr_t slab_base_page;   // page number of mem_heap_lo()
+
+/* recently freed blocks of each small size,still marked allocated */
+static block_t *quick_lists[QUICK_CLASSES];
+static unsigned quick_count[QUICK_CLASSES];
+static size_t quick_total;         // blocks in all quick lists
+
+/* hardened mode:next block for check_step,the call it runs for */
+static block_t *check_cursor;
+static const char *check_op = "init";
+static word_t canary_secret;
+
+/* counters behind mm_stats(),guarded by heap_lock in thread-safe mode */
+typedef struct
+{
+    uint64_t mallocs, frees, reallocs, callocs;
+    uint64_t splits, coalesces, extends;
+    uint64_t mmaps, munmaps;        // updated atomically,see stat_add()
+    size_t heap_size;               // bytes obtained with mem_sbrk
+    uint64_t mapped;                // bytes in mapped blocks,atomic too
+    size_t free_bytes;              // bytes in free blocks
+    size_t quick_bytes;             // bytes in blocks on the quick lists
+    size_t peak_in_use;
+    size_t free_class[MM_STATS_CLASSES];
+} stats_t;
+
+static stats_t stats;
+
+/* tunables,see mm_mallopt() */
+static size_t mmap_threshold = (1 << 17);
+static size_t trim_threshold = (1 << 18);
+
+/* sampling profiler,changes to the table hold prof_lock in thread-safe mode */
+static size_t prof_rate;                // mean bytes between samples,0: off
+static prof_bucket_t *prof_buckets[PROF_BUCKETS];
+static prof_sample_t *prof_free_samples;
+static char *prof_pool;                 // profiler memory,bump allocated
+static size_t prof_pool_left;
+static void *prof_pages;                // freed one-page mappings,linked
+static unsigned prof_npages;
+static char prof_path[256];             // file prefix of signalled dumps
+static unsigned prof_dumps;
+static volatile sig_atomic_t prof_dump_pending;
+static MM_TLS size_t prof_left;         // bytes until the next sample
+static MM_TLS bool prof_busy;           // inside the profiler,do not sample
+static MM_TLS uint64_t prof_seed;
+
+#ifdef MM_THREADS
+/* per-thread cache of allocated-looking slots, linked through payload */
+typedef struct
+{
+    void *head[TCACHE_CLASSES];
+    unsigned count[TCACHE_CLASSES];
+    bool registered;    // destructor installed for this thread
+    slab_heap_t *heap;  // slabs this thread owns,null before its first refill
+    uint64_t mallocs;   // calls not yet added to stats
+    uint64_t frees;
+    uint64_t callocs;
+} tcache_t;
+
+static __thread tcache_t tcache;
+
+/* protects heap_start, the free lists and the heap itself */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* protects the profiler's table,nothing else is locked while it is held */
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 bool mm_checkheap(int lineno);
 
 /* Function prototypes for internal helper routines */
+static void *heap_malloc(size_t size);
+static void heap_free(void *bp);
+static void heap_free_block(void *bp);
+static void *block_malloc(size_t size);
+static void *block_malloc_aligned(size_t align, size_t size);
+static void *block_calloc(size_t size);
+static void block_free(void *bp);
+static size_t usable_size(void *bp);
+#ifndef NDEBUG
+static bool sized_ok(void *bp, size_t size);
+#endif
+static bool resize_in_place(void *bp, size_t size);
+static void split_tail(block_t *block, size_t asize);
+static void *mmap_malloc(size_t size);
+static void *mmap_realloc(void *bp, size_t size);
+static void mmap_free(block_t *block);
+static void release_pages(block_t *block, char *lo, char *hi);
 static block_t *extend_heap(size_t size);
 static void place(block_t *block, size_t asize);
 static block_t *find_fit(size_t asize);
@@ -151,40 +555,163 @@ static block_t *find_prev(block_t *block);
 
 static bool check_in_heap(void *bp);
 static bool is_aligned(void *bp);
-static bool check_block(block_t *block);
+static const char *check_block(block_t *block);
+static const char *check_links(block_t *block);
+static bool link_ok(block_t *block);
+static void check_step(const char *op);
+static void check_allocated(block_t *block);
+static void check_quick(block_t *block);
+static void check_absorbed(block_t *block);
+static void check_fault(block_t *block, const char *what);
+static word_t canary_value(block_t *block);
+static void canary_set(block_t *block);
+static bool canary_ok(block_t *block);
 static void insert_list(block_t *block);
 static void remove_list(block_t *block);
 static void write_bit(block_t *block, size_t new_bit);
 static void free_bit(block_t *block,int bit);
 static size_t read_bit(block_t *block,int bit);
-static size_t get_block_offset(size_t asize);
+static void mapping_insert(size_t asize, size_t *fl, size_t *sl);
+static void mapping_search(size_t asize, size_t *fl, size_t *sl);
+static block_t *get_next_free(block_t *block);
+static block_t *get_prev_free(block_t *block);
+static void set_next_free(block_t *block, block_t *next);
+static void set_prev_free(block_t *block, block_t *prev);
+static block_t *link_to_block(link_t link);
+static link_t block_to_link(block_t *block);
+static size_t link_size(size_t size);
+
+static tree_node_t *tree_node(block_t *block);
+static bool tree_less(block_t *a, block_t *b);
+static bool tree_red(block_t *block);
+static void tree_rotate(block_t *block, int dir);
+static void tree_replace(block_t *block, block_t *child);
+static void tree_insert(block_t *block);
+static void tree_remove(block_t *block);
+static void tree_remove_fixup(block_t *block, block_t *parent);
+static block_t *tree_best_fit(size_t asize);
+static size_t tree_count(block_t *block);
+
+static void *slab_malloc(slab_heap_t *heap, size_t size);
+static void slab_free(slab_t *slab, void *bp);
+static void slab_remote_free(slab_heap_t *heap, void *bp);
+static slab_t *slab_new(slab_heap_t *heap, size_t index);
+static slab_t *find_slab(void *bp);
+static void slab_map_set(slab_t *slab, bool set);
+static void slab_unlink(slab_t *slab);
+static slab_t *segment_take(slab_heap_t *heap);
+static void segment_put(slab_t *slab);
+static void segment_unlink(segment_t *segment);
+static void slab_heap_lock(slab_heap_t *heap);
+static void slab_heap_unlock(slab_heap_t *heap);
+
+static void quick_free(block_t *block);
+static block_t *quick_malloc(size_t asize);
+static void quick_flush_class(size_t index);
+static void quick_flush(void);
+
+static bool arena_grow(mm_arena_t *arena, size_t size);
+
+static void *prof_malloc(size_t size);
+static void prof_record(block_t *block, size_t size, void **stack, int depth);
+static bool prof_forget(block_t *block);
+static char *prof_page(void);
+static prof_bucket_t *prof_bucket(void **stack, int depth);
+static void prof_counts(prof_bucket_t *bucket, uint64_t *count);
+static void *prof_alloc(size_t size);
+static prof_sample_t **prof_slot(block_t *block);
+static size_t prof_next(size_t rate);
+static void prof_handler(int signo);
+static void prof_dump_file(void);
+static void prof_maps(FILE *fp);
+
+static size_t batch_carve(size_t asize, size_t n, void **out);
+
+static void stat_add(uint64_t *counter, uint64_t n);
+static void stat_sub(uint64_t *counter, uint64_t n);
+static void stat_peak(void);
+static size_t stat_in_use(void);
+static block_t *largest_free(void);
+
+#ifdef MM_THREADS
+static void *tcache_malloc(size_t size);
+static void tcache_free(void *bp, size_t size);
+static void tcache_refill(size_t index);
+static void tcache_collect(void);
+static slab_heap_t *tcache_heap(void);
+static void tcache_drain(size_t index, unsigned n);
+static void tcache_register(void);
+static void tcache_make_key(void);
+static void tcache_destroy(void *arg);
+static void tcache_flush_stats(void);
+#ifndef DRIVER
+static void fork_register(void);
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+#endif
+#endif
 
 /*
  * mm_init:perform any necessary initializations,like allocating heap area
  *         
- * inintialize the segregated list,pointing to null
+ * inintialize the free lists,pointing to null
  * return false if there was a problem in performing initialization
  * source reference:csapp textbook and mm-baseline.c
  */
 bool mm_init(void){
 
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2*wsize));
+    // Create the initial empty heap,16 bytes ending in the epilogue so
+    // the first payload is 16-byte aligned whatever the word size
+    word_t *start = (word_t *)(mem_sbrk(16));
+    size_t last = 16/wsize - 1;
 
     if (start == (void *)-1){
         return false;
     }
 
-    start[0] = pack(dsize,true); // Prologue footer
-    start[1] = pack(dsize,true); // Epilogue header
-    start[1] |= second_bit_mask;
+    start[last-1] = pack(dsize,true); // Prologue footer
+    start[last] = pack(dsize,true); // Epilogue header
+    start[last] |= second_bit_mask;
     // Heap starts with first "block header", currently the epilogue footer
-    heap_start = (block_t *) &(start[1]);
-    start += 2*wsize;
+    heap_start = (block_t *) &(start[last]);
+    check_cursor = NULL;
+    // differs from run to run with address space randomization
+    canary_secret = (word_t)(((uintptr_t)start ^ (uintptr_t)&stats)
+                             * 0x9E3779B97F4A7C15u >> 7);
+
+    for (int i = 0; i < FL_COUNT; i++){
+        for (int j = 0; j < SL_COUNT; j++){
+            free_lists[i][j] = NULL;
+        }
+        sl_bitmap[i] = 0;
+    }
+    fl_bitmap = 0;
+    tree_root = NULL;
 
-    for (int i = 0; i < NUM_LIST; i++){
-        segregated_list[i] = NULL;
+    memset(&shared_slabs, 0, sizeof(shared_slabs));
+    memset(slab_map, 0, sizeof(slab_map));
+    thread_heaps = NULL;
+
+    for (int i = 0; i < QUICK_CLASSES; i++){
+        quick_lists[i] = NULL;
+        quick_count[i] = 0;
+    }
+    quick_total = 0;
+    slab_base_page = (uintptr_t)mem_heap_lo() >> slab_page_shift;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.heap_size = 16;
+
+#ifdef MM_THREADS
+    // cached blocks of the calling thread belonged to the old heap
+    for (int i = 0; i < TCACHE_CLASSES; i++){
+        tcache.head[i] = NULL;
+        tcache.count[i] = 0;
     }
+    tcache.mallocs = tcache.frees = tcache.callocs = 0;
+    tcache.heap = NULL;
+#endif
 
     // Extend the empty heap with a free block of chunksize bytes
     if (extend_heap(chunksize) == NULL){
@@ -196,11 +723,161 @@ bool mm_init(void){
 /*
  * malloc:return a pointer to an allocated block of at least size bytes
  *
+ * in thread-safe mode small sizes come from the thread cache first,
+ * everything else is served from the heap under heap_lock;
+ * a request the profiler samples gets its own mapping
+ * size 0 returns null under the driver
+ */
+void *malloc(size_t size)
+{
+    void *bp;
+
+#ifndef DRIVER
+    // as the process malloc,size 0 gets a unique pointer like glibc's:
+    // programs treat null from malloc(0) as running out of memory
+    size += (size == 0);
+#endif
+#ifdef MM_THREADS
+    tcache.mallocs += 1;
+#else
+    stats.mallocs += 1;
+#endif
+    // all the profiler costs a call that is not sampled
+    if ((prof_left -= size) >= prof_max && (bp = prof_malloc(size)) != NULL){
+        return bp;
+    }
+#ifdef MM_THREADS
+    return tcache_malloc(size);
+#else
+    return heap_malloc(size);
+#endif
+}
+
+/*
+ * free: free the block pointed to by *bp and return nothing
+ *
+ * in thread-safe mode small blocks go back to the thread cache
+ */
+void free(void *bp)
+{
+#ifdef MM_THREADS
+    tcache.frees += (bp != NULL);
+    tcache_free(bp, 0);
+#else
+    stats.frees += (bp != NULL);
+    heap_free(bp);
+#endif
+}
+
+/*
+ * free_sized:free bp,whose last malloc/realloc asked for size bytes
+ *
+ * a size above slab_max cannot be a slab slot,so the slab lookup is
+ * skipped;in thread-safe mode a slot goes to the cache of the class its
+ * size gives without reading the slab header,and a size of at most
+ * slab_max skips the mapping check:a small block the profiler sampled is
+ * a mapping all the same,heap_free sees its third bit and unmaps it
+ * debug builds check that size fits the block,see sized_ok
+ */
+void free_sized(void *bp, size_t size)
+{
+    dbg_requires(bp == NULL || sized_ok(bp, size));
+#ifdef MM_THREADS
+    tcache.frees += (bp != NULL);
+    tcache_free(bp, size);
+#else
+    stats.frees += (bp != NULL);
+    if (bp != NULL && size > slab_max)
+    {
+        check_step("free");
+        heap_free_block(bp);
+        return;
+    }
+    heap_free(bp);
+#endif
+}
+
+/*
+ * heap_malloc:allocate at least size bytes from the heap
+ *
+ * small sizes take a slab slot,the rest (or a small size whose slab
+ * could not be made) gets a block of its own
+ * caller holds heap_lock in thread-safe mode
+ */
+static void *heap_malloc(size_t size)
+{
+    void *bp;
+
+    if (heap_start == NULL) // Initialize heap if it isn't initialized
+    {
+        mm_init();
+    }
+    check_step("malloc");
+
+    if (size > 0 && size <= slab_max){
+        if ((bp = slab_malloc(&shared_slabs, size)) != NULL){
+            return bp;
+        }
+    }else if (size >= mmap_threshold){
+        if ((bp = mmap_malloc(size)) != NULL){
+            return bp;
+        }
+    }
+    return block_malloc(size);
+}
+
+/*
+ * heap_free: return bp to its slab or to the free lists
+ *
+ * a slot of a thread heap goes on that heap's remote free list
+ * caller holds heap_lock in thread-safe mode
+ */
+static void heap_free(void *bp){
+
+    slab_t *slab;
+
+    if (bp == NULL){
+        return;
+    }
+    check_step("free");
+
+    if ((slab = find_slab(bp)) != NULL){
+        if (slab->heap != &shared_slabs){
+            // its owner may be using the slab right now
+            slab_remote_free(slab->heap, bp);
+        }else{
+            slab_free(slab, bp);
+        }
+        return;
+    }
+    heap_free_block(bp);
+}
+
+/*
+ * heap_free_block:free bp,which is not a slab slot,to the quick or free
+ *                 lists,or unmap it
+ * caller holds heap_lock in thread-safe mode
+ */
+static void heap_free_block(void *bp){
+
+    check_allocated(payload_to_header(bp));
+    if (read_bit(payload_to_header(bp), 3)){
+        mmap_free(payload_to_header(bp));
+    }else if (get_size(payload_to_header(bp)) <= quick_max){
+        quick_free(payload_to_header(bp));
+    }else{
+        block_free(bp);
+    }
+}
+
+/*
+ * block_malloc:allocate a block of at least size bytes from the heap
+ *
  * size aligned to 16 bytes and find a fit block within heap
  * and extend the heap when needed
  * source reference:mm-baseline.c
  */
-void *malloc(size_t size)
+static void *block_malloc(size_t size)
 {
     //dbg_requires(mm_checkheap(__LINE__));
     size_t asize;      // Adjusted block size
@@ -208,11 +885,6 @@ void *malloc(size_t size)
     block_t *block;
     void *bp = NULL;
 
-    if (heap_start == NULL) // Initialize heap if it isn't initialized
-    {
-        mm_init();
-    }
-
     if (size == 0) // Ignore spurious request
     {
         dbg_ensures(mm_checkheap(__LINE__));
@@ -220,8 +892,14 @@ void *malloc(size_t size)
     }
 
     // Adjust block size to include overhead and to meet alignment requirements
-    asize=round_up(size+wsize,16);
-    
+    asize=max(round_up(size+wsize+canary_size,16),min_block_size);
+
+    // A recently freed block of exactly this size needs no split
+    if (asize <= quick_max && (block = quick_malloc(asize)) != NULL)
+    {
+        return header_to_payload(block);
+    }
+
     // Search the free list for a fit
     block = find_fit(asize);
 
@@ -245,108 +923,2267 @@ void *malloc(size_t size)
 }
 
 /*
- * free: free the block pointed to by *bp and return nothing
+ * block_malloc_aligned:allocate a block whose payload is align-aligned
+ *
+ * take a fit with room for the worst-case leading gap,give the gap back
+ * to the free lists as its own block and place the aligned rest
+ * align must be a power of two of at least 16
+ */
+static void *block_malloc_aligned(size_t align, size_t size){
+
+    size_t asize = max(round_up(size+wsize+canary_size,16),min_block_size);
+    size_t search = asize + align + min_block_size;
+    size_t csize, gap;
+    uintptr_t payload, aligned;
+    block_t *block, *block_aligned;
+
+    if ((block = find_fit(search)) == NULL){
+        if ((block = extend_heap(max(search, chunksize))) == NULL){
+            return NULL;
+        }
+    }
+
+    // the gap must be empty or big enough to be a free block
+    payload = (uintptr_t)header_to_payload(block);
+    aligned = round_up(payload, align);
+    if (aligned != payload && aligned - payload < min_block_size){
+        aligned += align;
+    }
+    gap = aligned - payload;
+
+    if (gap > 0){
+        stats.splits += 1;
+        csize = get_size(block);
+        remove_list(block);
+        write_header(block, gap, false);
+        write_bit(block, second_bit_mask);
+        write_footer(block, gap, false);
+        insert_list(block);
+
+        block_aligned = find_next(block);
+        write_header(block_aligned, csize-gap, false);
+        write_footer(block_aligned, csize-gap, false);
+        insert_list(block_aligned);
+        block = block_aligned;
+    }
+
+    place(block, asize);
+    return header_to_payload(block);
+}
+
+/*
+ * block_calloc:allocate a zeroed block of at least size bytes
+ *
+ * like block_malloc,but a fit that is known to be zero only has its
+ * old list pointers and footer word cleared instead of the whole payload
+ * caller holds heap_lock in thread-safe mode
+ */
+static void *block_calloc(size_t size){
+
+    size_t asize = max(round_up(size+wsize+canary_size,16),min_block_size);
+    block_t *block;
+    bool zero;
+    size_t links;
+    char *bp;
+
+    if (heap_start == NULL){
+        mm_init();
+    }
+    if ((block = find_fit(asize)) == NULL){
+        if ((block = extend_heap(max(asize, chunksize))) == NULL){
+            return NULL;
+        }
+    }
+
+    zero = read_bit(block, 3);
+    links = link_size(get_size(block));
+    place(block, asize);
+    bp = header_to_payload(block);
+    if (zero){
+        if (links > get_payload_size(block)){
+            links = get_payload_size(block);
+        }
+        memset(bp, 0, links);
+        memset(bp + get_payload_size(block) - wsize, 0, wsize);
+    }else{
+        memset(bp, 0, size);
+    }
+    return bp;
+}
+
+/*
+ * block_free: return the block pointed to by *bp to the free lists
  *
  * free(NULL) has no effect;write the header/footer
  * target block should have been allocated earlier
+ * a coalesced block of at least trim_threshold bytes gives its pages back:
+ * only the freed part if a neighbour it merged with did so already
  */
-void free (void *bp){
+static void block_free(void *bp){
 
     if (bp == NULL){
         return;
     }
 
     block_t *block = payload_to_header(bp);
+    block_t *block_next = find_next(block);
     size_t size = get_size(block);
     size_t second_bit = read_bit(block, 2);
-    size_t third_bit = read_bit(block, 3);
+    bool trimmed = false;  // a free neighbour already released its pages
+
+    if (!second_bit){
+        trimmed = read_bit(find_prev(block), 4);
+    }
+    if (!get_alloc(block_next)){
+        trimmed = trimmed || read_bit(block_next, 4);
+    }
+
     write_header(block, size, false);
     write_footer(block, size, false);
     write_bit(block, second_bit);
-    write_bit(block, third_bit);
-    coalesce(block);
+    block_t *merged = coalesce(block);
+
+    if (get_size(merged) >= trim_threshold){
+        if (trimmed){
+            release_pages(merged, (char *)block, (char *)block + size);
+        }else{
+            release_pages(merged, (char *)merged,
+                          (char *)merged + get_size(merged));
+        }
+        write_bit(merged, fourth_bit_mask);
+    }
 
     return;
 }
 
 /*
- * realloc:return a pointer to an allocated region of
- *         at least size bytes
- *
- * if ptr==null,call malloc()
- * copy(and free) old data to new block
- * source reference:mm-baseline.c
+ * release_pages: give the whole pages of [lo,hi) back to the OS,leaving
+ *                the header,links and footer of free block intact
  */
-void *realloc(void *ptr, size_t size)
-{
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
+static void release_pages(block_t *block, char *lo, char *hi){
 
-    // If size == 0, then free block and return NULL
-    if (size == 0)
-    {
-        free(ptr);
-        return NULL;
-    }
+    char *first = (char *)block + wsize + link_size(get_size(block));
+    char *last = (char *)block + get_size(block) - wsize;
+    uintptr_t start = round_up((uintptr_t)(lo > first ? lo : first), page_size);
+    uintptr_t end = ((uintptr_t)(hi < last ? hi : last)) & ~(page_size - 1);
 
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL)
-    {
-        return malloc(size);
+    if (start < end){
+        madvise((void *)start, end - start, MADV_DONTNEED);
     }
+}
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL)
-    {
+/*
+ * mmap_malloc: give a large request a private mapping of its own
+ *
+ * the header sits one word before offset 16 so the payload stays 16-byte
+ * aligned;its size is the mapping length minus 16,so the payload size
+ * the header promises is the length minus wsize+16 (and the canary).
+ * the first 8 bytes point to the sample of a sampled mapping.a page
+ * the profiler kept is used before a new mapping
+ * return null if the mapping fails or its size would not fit a header
+ */
+static void *mmap_malloc(size_t size){
+
+    size_t len;
+    char *base;
+    block_t *block;
+
+    if (size > block_max - page_size - 16){
         return NULL;
     }
+    len = round_up(size + wsize + canary_size + 16, page_size);
+    if (len > page_size || (base = prof_page()) == NULL){
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED){
+            return NULL;
+        }
+    }
 
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
+    block = (block_t *)(base + 16 - wsize);
+    write_header(block, len - 16, true);
+    write_bit(block, second_bit_mask | third_bit_mask);
+    canary_set(block);
+    stat_add(&stats.mmaps, 1);
+    stat_add(&stats.mapped, len);
+    return header_to_payload(block);
+}
+
+/*
+ * mmap_realloc: resize a mapped block with mremap,which may move it
+ *               without copying;return null where mremap is unavailable
+ */
+static void *mmap_realloc(void *bp, size_t size){
+
+#ifdef MREMAP_MAYMOVE
+    block_t *block = payload_to_header(bp);
+    size_t old_len, len;
+    char *base;
+
+    if (size > block_max - page_size - 16){
+        return NULL;
+    }
+    old_len = get_size(block) + 16;
+    len = round_up(size + wsize + canary_size + 16, page_size);
+    base = mremap((char *)block - (16 - wsize), old_len, len, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED){
+        return NULL;
+    }
+    stat_add(&stats.mapped, len - old_len);    // wraps around when shrinking
+    block = (block_t *)(base + 16 - wsize);
+    write_header(block, len - 16, true);
+    write_bit(block, second_bit_mask | third_bit_mask);
+    canary_set(block);
+    return header_to_payload(block);
+#else
+    (void)bp;
+    (void)size;
+    return NULL;
+#endif
+}
+
+/*
+ * mmap_free: unmap a block made by mmap_malloc,a sampled one leaves
+ *            the profile first and its page may be kept for the next
+ */
+static void mmap_free(block_t *block){
+
+    size_t len = get_size(block) + 16;
+
+    if (!read_bit(block, 4) || !prof_forget(block)){
+        munmap((char *)block - (16 - wsize), len);
+    }
+    stat_add(&stats.munmaps, 1);
+    stat_sub(&stats.mapped, len);
+}
+
+/*
+ * mm_mallopt: set a tunable (MM_OPT_* in mm-ext.h)
+ *             return 1 on success,0 for an unknown parameter
+ */
+int mm_mallopt(int param, size_t value){
+
+    int ok = 1;
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+#endif
+    switch (param){
+    case MM_OPT_MMAP_THRESHOLD:
+        mmap_threshold = max(value, slab_max + 1);
+        break;
+    case MM_OPT_TRIM_THRESHOLD:
+        trim_threshold = max(value, 2*page_size);
+        break;
+    case MM_OPT_PROF_SAMPLE:
+        // other threads pick the rate up within prof_idle bytes
+        __atomic_store_n(&prof_rate, value < prof_rate_max ? value
+                         : prof_rate_max, __ATOMIC_RELAXED);
+        prof_left = prof_next(prof_rate);
+        break;
+    default:
+        ok = 0;
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    return ok;
+}
+
+/*
+ * resize_in_place: try to make the allocation at bp hold size bytes
+ *                  without moving it,return false if it has to move
+ *
+ * a slab slot or mapped block only stays if size still fits.a block shrinks by
+ * splitting off its tail,grows by absorbing a free next block,and when
+ * it is the last block before the epilogue (maybe followed by free space)
+ * the heap is extended right behind it
+ * caller holds heap_lock in thread-safe mode
+ */
+static bool resize_in_place(void *bp, size_t size){
+
+    slab_t *slab = find_slab(bp);
+    block_t *block, *block_next;
+    size_t asize, csize, avail, prev_alloc;
+
+    if (slab){
+        // a size of another class moves,so free_sized finds the class
+        return (size-1)/16 == slab->index;
+    }
+
+    block = payload_to_header(bp);
+    check_allocated(block);
+    csize = get_size(block);
+    asize = max(round_up(size+wsize+canary_size,16),min_block_size);
+
+    if (read_bit(block, 3)){
+        // a mapping keeps its size while the request still fits,
+        // a sampled one moves so the profile sees the new size
+        return asize <= csize && size >= mmap_threshold && !read_bit(block, 4);
+    }
+    block_next = find_next(block);
+
+    if (asize <= csize){
+        split_tail(block, asize);
+        return true;
+    }
+
+    avail = csize;
+    if (!get_alloc(block_next)){
+        avail += get_size(block_next);
+        if (avail < asize && get_size(find_next(block_next)) == 0){
+            // free space up to the epilogue: grow it,extend_heap coalesces
+            if (extend_heap(max(asize - avail, chunksize)) == NULL){
+                return false;
+            }
+            avail = csize + get_size(block_next);
+        }
+    }else if (get_size(block_next) == 0){
+        // last block: the new space starts right behind it
+        if (extend_heap(max(asize - csize, chunksize)) == NULL){
+            return false;
+        }
+        block_next = find_next(block);
+        avail += get_size(block_next);
+    }
+
+    if (avail < asize){
+        return false;
+    }
+
+    prev_alloc = read_bit(block, 2);
+    remove_list(block_next);
+    write_header(block, avail, true);
+    write_bit(block, prev_alloc);
+    write_bit(find_next(block), second_bit_mask);
+    check_absorbed(block);
+    split_tail(block, asize);
+    stat_peak();
+    return true;
+}
+
+/*
+ * split_tail: cut an allocated block down to asize and free the rest,
+ *             merging it with a free next block
+ *             nothing happens if the rest is below min_block_size
+ *             (apart from the canary,the block may have just grown)
+ */
+static void split_tail(block_t *block, size_t asize){
+
+    size_t csize = get_size(block);
+    size_t prev_alloc = read_bit(block, 2);
+    block_t *block_next;
+
+    if (csize - asize < min_block_size){
+        canary_set(block);
+        return;
+    }
+    stats.splits += 1;
+    write_header(block, asize, true);
+    write_bit(block, prev_alloc);
+    block_next = find_next(block);
+    write_header(block_next, csize-asize, false);
+    write_footer(block_next, csize-asize, false);
+    write_bit(block_next, second_bit_mask);
+    coalesce(block_next);
+    canary_set(block);
+}
+
+#ifndef NDEBUG
+/*
+ * sized_ok:whether size could be what the last malloc/realloc of bp asked
+ *          for,so free_sized may trust it;0 tells nothing
+ *
+ * a slot only holds sizes of its own class,a heap block is less than a
+ * minimum block bigger than size needs (place and split_tail split off
+ * the rest),a mapping holds a size above slab_max or was sampled with
+ * less than a page to spare
+ */
+static bool sized_ok(void *bp, size_t size){
+
+    slab_t *slab = find_slab(bp);
+    block_t *block = payload_to_header(bp);
+    size_t asize, psize;
+
+    if (size == 0){
+        return true;
+    }
+    if (slab){
+        return (size-1)/16 == slab->index;
+    }
+    psize = get_payload_size(block);
+    if (size > psize){
+        return false;
+    }
+    if (read_bit(block, 3)){
+        return size > slab_max
+            || (read_bit(block, 4) && psize - size < page_size);
+    }
+    asize = max(round_up(size+wsize+canary_size,16),min_block_size);
+    return get_size(block) - asize < min_block_size;
+}
+#endif
+
+/*
+ * usable_size: number of payload bytes behind bp
+ */
+static size_t usable_size(void *bp){
+
+    slab_t *slab = find_slab(bp);
+
+    if (slab){
+        return (slab->index+1)*16;
+    }
+    return get_payload_size(payload_to_header(bp));
+}
+
+/*
+ * realloc:return a pointer to an allocated region of
+ *         at least size bytes
+ *
+ * if ptr==null,call malloc()
+ * keep the block where it is when resize_in_place can,
+ * else copy(and free) old data to new block
+ * source reference:mm-baseline.c
+ */
+void *realloc(void *ptr, size_t size)
+{
+    size_t copysize;
+    void *newptr;
+
+    // If size == 0, then free block and return NULL
+    // (realloc(NULL, 0) is malloc(0),which is not null as the process malloc)
+    if (size == 0 && ptr != NULL)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL)
+    {
+        return malloc(size);
+    }
+
+    // Shrink or grow without moving when the heap around ptr allows it
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+#endif
+    stats.reallocs += 1;
+    check_step("realloc");
+    bool resized = resize_in_place(ptr, size);
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    if (resized)
+    {
+        return ptr;
+    }
+
+    // A mapped block that stays large is remapped rather than copied
+    // (a sampled one is not,its sample goes with the old size)
+    if (!find_slab(ptr) && read_bit(payload_to_header(ptr), 3)
+            && !read_bit(payload_to_header(ptr), 4) && size >= mmap_threshold)
+    {
+        if ((newptr = mmap_realloc(ptr, size)) != NULL)
+        {
+            return newptr;
+        }
+    }
+
+    // Otherwise, proceed with reallocation
+    newptr = malloc(size);
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL)
+    {
+        return NULL;
+    }
+
+    // Copy the old data
+    copysize = usable_size(ptr); // gets size of old payload
     if(size < copysize)
     {
         copysize = size;
     }
-    memcpy(newptr, ptr, copysize);
+    memcpy(newptr, ptr, copysize);
+
+    // Free the old block
+    free(ptr);
+
+    return newptr;
+}
+
+/*
+ * calloc:allocate memory for an array and return a pointer
+ *                 to the allocated memory
+ *
+ * the memory is set to 0 before returning;blocks above slab_max come from
+ * mmap_malloc,whose mapping is zero from the start and is never cleared,
+ * or from block_calloc,which knows when a block is zero already
+ * source reference:mm-baseline.c
+ */
+void *calloc(size_t elements, size_t size)
+{
+    void *bp;
+    size_t asize = elements * size;
+
+    if (elements != 0 && asize/elements != size)
+    // Multiplication overflowed
+    return NULL;
+
+#ifndef DRIVER
+    asize += (asize == 0);  // a unique pointer,as malloc(0) gives
+#endif
+#ifdef MM_THREADS
+    tcache.mallocs += 1;
+    tcache.callocs += 1;
+#else
+    stats.mallocs += 1;
+    stats.callocs += 1;
+#endif
+    // counted down here,not by malloc;a sampled block is a mapping,so zero
+    if ((prof_left -= asize) >= prof_max && (bp = prof_malloc(asize)) != NULL)
+    {
+        return bp;
+    }
+
+    if (asize <= slab_max)
+    {
+        // not malloc+memset,which the compiler may turn back into calloc
+#ifdef MM_THREADS
+        bp = tcache_malloc(asize);
+#else
+        bp = heap_malloc(asize);
+#endif
+        if (bp != NULL)
+        {
+            memset(bp, 0, asize);
+        }
+        return bp;
+    }
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+#endif
+    if (heap_start == NULL)
+    {
+        mm_init();
+    }
+    check_step("calloc");
+    // a fresh mapping is zero already,anything else goes to block_calloc
+    if (asize < mmap_threshold || (bp = mmap_malloc(asize)) == NULL)
+    {
+        bp = block_calloc(asize);
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    return bp;
+}
+
+/*
+ * memalign:allocate size bytes at an address that is a multiple of align
+ *
+ * align must be a power of two;up to 16 bytes any block will do,
+ * larger alignments are cut from a free block by block_malloc_aligned
+ * return null for a bad alignment,size 0 or when the heap cannot grow
+ */
+void *memalign(size_t align, size_t size)
+{
+    void *bp;
+
+    if (align == 0 || (align & (align - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (align <= 16)
+    {
+        return malloc(size);
+    }
+#ifndef DRIVER
+    size += (size == 0);
+#endif
+    if (size == 0 || size > SIZE_MAX - 2*align - 2*min_block_size)
+    {
+        return NULL;
+    }
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+#endif
+    if (heap_start == NULL)
+    {
+        mm_init();
+    }
+    check_step("memalign");
+    bp = block_malloc_aligned(align, size);
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    if (bp == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return bp;
+}
+
+/*
+ * aligned_alloc:C11 aligned allocation,same as memalign
+ */
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+/*
+ * posix_memalign:store a pointer to size bytes aligned to align in *memptr
+ *
+ * return EINVAL unless align is a power of two multiple of sizeof(void *),
+ * ENOMEM when no memory is left;*memptr is only written on success
+ */
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *bp;
+
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+    {
+        return EINVAL;
+    }
+    bp = memalign(align, size);
+    if (bp == NULL && size != 0)
+    {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
+
+/*
+ * malloc_usable_size:number of bytes the caller may use at bp,
+ *                    which can be more than it asked for
+ */
+size_t malloc_usable_size(void *bp)
+{
+    if (bp == NULL)
+    {
+        return 0;
+    }
+    return usable_size(bp);
+}
+
+#ifndef DRIVER
+/*
+ * valloc/pvalloc:page-aligned allocation,only kept so that a program
+ *                running on mm.c never hands our blocks to another free()
+ */
+void *valloc(size_t size)
+{
+    return memalign(page_size, size);
+}
+
+void *pvalloc(size_t size)
+{
+    return memalign(page_size, round_up(size, page_size));
+}
+#endif
+
+/*
+ * mm_malloc_batch:allocate n blocks of size bytes into out[0..n)
+ *
+ * one lock round trip for the whole batch.a regular size is carved back
+ * to back from one free block of n times the size (find_fit flushes the
+ * quick lists if that is what it takes);slab and mapped sizes are
+ * allocated one by one,and so is a batch the heap cannot grow for
+ * return how many of out were filled,n unless out of memory
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out){
+
+    size_t i = 0;
+    size_t asize = max(round_up(size+wsize+canary_size,16),min_block_size);
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    tcache_flush_stats();
+#endif
+    if (heap_start == NULL){
+        mm_init();
+    }
+    check_step("mm_malloc_batch");
+    if (size > slab_max && size < mmap_threshold && n > 1){
+        i = batch_carve(asize, n, out);
+    }
+    for (; i < n; i++){
+        if ((out[i] = heap_malloc(size)) == NULL){
+            break;
+        }
+    }
+    stats.mallocs += i;
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    return i;
+}
+
+/*
+ * mm_free_batch:free the n pointers of ptrs (null entries are skipped)
+ *
+ * blocks of the batch that lie next to each other in the heap are merged
+ * into one run,which is freed and coalesced with its neighbours once.
+ * without sorting:the first pass marks the blocks (not slab slots or
+ * mappings) with the fourth bit;the second grows a run from each block
+ * still marked over the marked blocks (and earlier runs) behind it,
+ * unmarking what it takes;the third frees the slots,the mappings and
+ * the runs,whose heads are the blocks still marked.a sampled mapping
+ * carries the fourth bit too,so the last two passes test the third bit
+ * first and leave mappings to heap_free.hardened mode frees the pointers
+ * one by one
+ */
+void mm_free_batch(void **ptrs, size_t n){
+
+    size_t i, size, prev_alloc;
+    block_t *block, *block_next;
+    void *bp;
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    tcache_flush_stats();
+#endif
+    check_step("mm_free_batch");
+    if (hardened){
+        // quick blocks carry the fourth bit there,so no runs are merged
+        for (i = 0; i < n; i++){
+            stats.frees += (ptrs[i] != NULL);
+            heap_free(ptrs[i]);
+        }
+#ifdef MM_THREADS
+        pthread_mutex_unlock(&heap_lock);
+#endif
+        return;
+    }
+    for (i = 0; i < n; i++){
+        if ((bp = ptrs[i]) == NULL){
+            continue;
+        }
+        stats.frees += 1;
+        if (!find_slab(bp) && !read_bit(payload_to_header(bp), 3)){
+            write_bit(payload_to_header(bp), fourth_bit_mask);
+        }
+    }
+
+    for (i = 0; i < n; i++){
+        if ((bp = ptrs[i]) == NULL || find_slab(bp)
+                || read_bit(payload_to_header(bp), 3)
+                || !read_bit(payload_to_header(bp), 4)){
+            continue;
+        }
+        block = payload_to_header(bp);
+        size = get_size(block);
+        block_next = find_next(block);
+        while (get_alloc(block_next) && read_bit(block_next, 4)){
+            free_bit(block_next, 4);
+            size += get_size(block_next);
+            stats.coalesces += 1;
+            block_next = find_next(block_next);
+        }
+        // the run is one allocated block,still marked as a run head
+        prev_alloc = read_bit(block, 2);
+        write_header(block, size, true);
+        write_bit(block, prev_alloc);
+        write_bit(block, fourth_bit_mask);
+    }
+
+    for (i = 0; i < n; i++){
+        if ((bp = ptrs[i]) == NULL){
+            continue;
+        }
+        block = payload_to_header(bp);
+        if (find_slab(bp) || read_bit(block, 3)){
+            heap_free(bp);
+        }else if (read_bit(block, 4)){
+            free_bit(block, 4);
+            heap_free(bp);
+        }
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+/*
+ * batch_carve:cut n allocated blocks of asize bytes from a single fit,
+ *             extending the heap if none is free;return n,or 0 if the
+ *             heap cannot grow
+ *
+ * like place for n blocks at once:the rest of the fit becomes a free
+ * block,or goes to the last block when it is too small for that
+ */
+static size_t batch_carve(size_t asize, size_t n, void **out){
+
+    size_t i, total, csize, prev_alloc, zero;
+    block_t *block, *last;
+
+    if (n > (SIZE_MAX - chunksize) / asize){
+        return 0;
+    }
+    total = asize * n;
+    if ((block = find_fit(total)) == NULL){
+        if ((block = extend_heap(max(total, chunksize))) == NULL){
+            return 0;
+        }
+    }
+
+    csize = get_size(block) - total;    // left over behind the batch
+    prev_alloc = read_bit(block, 2);
+    zero = read_bit(block, 3);
+    remove_list(block);
+    for (i = 0; i < n; i++){
+        write_header(block, asize, true);
+        write_bit(block, i == 0 ? prev_alloc : second_bit_mask);
+        canary_set(block);
+        out[i] = header_to_payload(block);
+        block = find_next(block);
+    }
+
+    if (csize >= min_block_size){
+        stats.splits += 1;
+        write_header(block, csize, false);
+        write_footer(block, csize, false);
+        write_bit(block, second_bit_mask);
+        if (zero){
+            write_bit(block, third_bit_mask);
+        }
+        coalesce(block);
+    }else{
+        last = payload_to_header(out[n-1]);
+        write_header(last, asize + csize, true);
+        write_bit(last, n == 1 ? prev_alloc : second_bit_mask);
+        write_bit(find_next(last), second_bit_mask);
+        canary_set(last);
+    }
+    stat_peak();
+    return n;
+}
+
+/*
+ * mm_arena_create:make an empty arena whose chunks hold at least
+ *                 chunk_size bytes (0 for the default)
+ *
+ * the arena itself is a small malloc'd block;chunks come on first use
+ * an arena belongs to one thread,only its chunks are taken under heap_lock
+ */
+mm_arena_t *mm_arena_create(size_t chunk_size){
+
+    mm_arena_t *arena = malloc(sizeof(mm_arena_t));
+
+    if (arena == NULL){
+        return NULL;
+    }
+    if (chunk_size == 0){
+        chunk_size = arena_chunk_default;
+    }
+    arena->chunks = NULL;
+    arena->cur = NULL;
+    arena->chunk_size = max(round_up(chunk_size, 16), chunksize);
+    return arena;
+}
+
+/*
+ * mm_arena_alloc:bump-allocate size bytes from the arena,16-byte aligned
+ *
+ * the memory lives until the arena is reset or destroyed;
+ * there is no per-object free
+ * return null for size 0 or when the heap cannot grow
+ */
+void *mm_arena_alloc(mm_arena_t *arena, size_t size){
+
+    char *bp;
+
+    if (size == 0 || size > SIZE_MAX/2){
+        return NULL;
+    }
+    size = round_up(size, 16);
+
+    if (arena->chunks == NULL
+            || size > (size_t)(arena->chunks->end - arena->cur)){
+        if (!arena_grow(arena, size)){
+            return NULL;
+        }
+    }
+    bp = arena->cur;
+    arena->cur += size;
+    return bp;
+}
+
+/*
+ * mm_arena_reset:free every object of the arena at once
+ *
+ * older chunks go back to the heap,the newest one (which grew
+ * the most) is kept so the next round does not touch the heap
+ */
+void mm_arena_reset(mm_arena_t *arena){
+
+    arena_chunk_t *chunk, *next;
+
+    if (arena->chunks == NULL){
+        return;
+    }
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+#endif
+    for (chunk = arena->chunks->next; chunk != NULL; chunk = next){
+        next = chunk->next;
+        block_free(chunk);
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    arena->chunks->next = NULL;
+    arena->cur = arena->chunks->data;
+}
+
+/*
+ * mm_arena_destroy:give all chunks of the arena back and free it
+ */
+void mm_arena_destroy(mm_arena_t *arena){
+
+    arena_chunk_t *chunk, *next;
+
+    if (arena == NULL){
+        return;
+    }
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+#endif
+    for (chunk = arena->chunks; chunk != NULL; chunk = next){
+        next = chunk->next;
+        block_free(chunk);
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    free(arena);
+}
+
+/*
+ * mm_stats:fill *st with the allocator counters
+ *
+ * counters are kept by the allocation paths,only the largest free block
+ * is looked up (in the highest non-empty free list).blocks on the quick
+ * lists are reported apart,reading the counters leaves them where they
+ * are.in thread-safe mode calls served by other threads' caches show up
+ * once they next lock
+ */
+void mm_stats(mm_stats_t *st){
+
+    block_t *block;
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    tcache_flush_stats();
+#endif
+    memset(st, 0, sizeof(*st));
+    st->heap_size = stats.heap_size;
+    st->mapped = __atomic_load_n(&stats.mapped, __ATOMIC_RELAXED);
+    st->in_use = stat_in_use();
+    st->peak_in_use = stats.peak_in_use;
+    st->free = stats.free_bytes;
+    st->quick = stats.quick_bytes;
+    st->largest_free = (block = largest_free()) ? get_size(block) : 0;
+    if (st->free > 0){
+        st->fragmentation = 1.0 - (double)st->largest_free / st->free;
+    }
+    memcpy(st->free_class, stats.free_class, sizeof(st->free_class));
+
+    st->mallocs = stats.mallocs;
+    st->frees = stats.frees;
+    st->reallocs = stats.reallocs;
+    st->callocs = stats.callocs;
+    st->splits = stats.splits;
+    st->coalesces = stats.coalesces;
+    st->extends = stats.extends;
+    st->mmaps = __atomic_load_n(&stats.mmaps, __ATOMIC_RELAXED);
+    st->munmaps = __atomic_load_n(&stats.munmaps, __ATOMIC_RELAXED);
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+/*
+ * mm_stats_print:write the counters of mm_stats() to fp as text,
+ *                free bytes only for classes that have any
+ */
+void mm_stats_print(FILE *fp){
+
+    int i;
+    mm_stats_t st;
+
+    mm_stats(&st);
+    fprintf(fp, "heap size      %12zu\n", st.heap_size);
+    fprintf(fp, "in use         %12zu  (peak %zu)\n", st.in_use, st.peak_in_use);
+    fprintf(fp, "free           %12zu  (largest %zu, fragmentation %.3f)\n",
+            st.free, st.largest_free, st.fragmentation);
+    fprintf(fp, "quick          %12zu\n", st.quick);
+    fprintf(fp, "mapped         %12zu\n", st.mapped);
+    for (i = 0; i < MM_STATS_CLASSES; i++){
+        if (st.free_class[i]){
+            fprintf(fp, "  free [2^%d,2^%d) %12zu\n", i, i + 1, st.free_class[i]);
+        }
+    }
+    fprintf(fp, "malloc %llu  free %llu  realloc %llu  calloc %llu\n",
+            st.mallocs, st.frees, st.reallocs, st.callocs);
+    fprintf(fp, "split %llu  coalesce %llu  extend %llu  mmap %llu  munmap %llu\n",
+            st.splits, st.coalesces, st.extends, st.mmaps, st.munmaps);
+}
+
+/*
+ * mm_prof_dump:write the sampled allocations that are still live to fp
+ *              as a heap profile,return 0 or -1 if writing failed
+ *
+ * one line per stack:live samples and their bytes,all samples ever taken
+ * there and their bytes,then the return addresses.the counts are raw,
+ * pprof scales them back up by the rate in the header (heap_v2),and the
+ * memory map that follows lets it symbolize the addresses
+ *
+ * stdio may allocate,so prof_lock is not taken:buckets are only ever
+ * added,at the head of their chain,and the counts are read as they are.
+ * samples taken or freed meanwhile may show in one line and not another
+ */
+int mm_prof_dump(FILE *fp){
+
+    size_t i;
+    uint32_t j;
+    bool busy = prof_busy;
+    prof_bucket_t *bucket;
+    uint64_t count[4], total[4] = {0, 0, 0, 0};
+
+    prof_busy = true;   // what stdio allocates here is not sampled
+    for (i = 0; i < PROF_BUCKETS; i++){
+        for (bucket = __atomic_load_n(&prof_buckets[i], __ATOMIC_ACQUIRE);
+             bucket; bucket = bucket->next){
+            prof_counts(bucket, count);
+            for (j = 0; j < 4; j++){
+                total[j] += count[j];
+            }
+        }
+    }
+    fprintf(fp, "heap profile: %6" PRIu64 ": %8" PRIu64 " [%6" PRIu64
+            ": %8" PRIu64 "] @ heap_v2/%zu\n", total[0], total[1],
+            total[2], total[3], prof_rate);
+    for (i = 0; i < PROF_BUCKETS; i++){
+        for (bucket = __atomic_load_n(&prof_buckets[i], __ATOMIC_ACQUIRE);
+             bucket; bucket = bucket->next){
+            prof_counts(bucket, count);
+            fprintf(fp, "%6" PRIu64 ": %8" PRIu64 " [%6" PRIu64 ": %8"
+                    PRIu64 "] @", count[0], count[1], count[2], count[3]);
+            for (j = 0; j < bucket->depth; j++){
+                fprintf(fp, " 0x%" PRIxPTR, (uintptr_t)bucket->stack[j]);
+            }
+            fputc('\n', fp);
+        }
+    }
+    prof_maps(fp);
+    prof_busy = busy;
+    return ferror(fp) ? -1 : 0;
+}
+
+/*
+ * mm_prof_signal:write the profile to path.<pid>.<n>.heap whenever signo
+ *                arrives,return 0 or -1 with errno set
+ *
+ * the handler only asks for the dump:the next call that reaches
+ * prof_malloc writes it,which is normally the next malloc of the thread
+ * the signal interrupted
+ */
+int mm_prof_signal(int signo, const char *path){
+
+    struct sigaction sa;
+
+    if (strlen(path) >= sizeof(prof_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(prof_path, path);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(signo, &sa, NULL);
+}
+
+#ifndef DRIVER
+/*
+ * prof_env:run before main,start the profiler from the environment,the
+ *          only way to reach it in a program that mm.c is LD_PRELOADed
+ *          under (see memlib-os.c)
+ *
+ *   MM_PROF_SAMPLE=bytes   mean bytes between samples,e.g. 524288
+ *   MM_PROF_FILE=prefix    SIGUSR2 dumps to prefix.<pid>.<n>.heap,
+ *                          mm.<pid>.<n>.heap by default
+ */
+__attribute__((constructor))
+static void prof_env(void){
+
+    const char *rate = getenv("MM_PROF_SAMPLE");
+    const char *path = getenv("MM_PROF_FILE");
+
+    if (rate == NULL || strtoull(rate, NULL, 10) == 0){
+        return;
+    }
+    mm_mallopt(MM_OPT_PROF_SAMPLE, strtoull(rate, NULL, 10));
+    mm_prof_signal(SIGUSR2, path ? path : "mm");
+}
+#endif
+
+
+/******** The remaining content below are helper and debug routines ********/
+
+/*
+ * stat_add:add n to a counter that is updated without heap_lock
+ */
+static void stat_add(uint64_t *counter, uint64_t n){
+
+#ifdef MM_THREADS
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+    *counter += n;
+#endif
+}
+
+static void stat_sub(uint64_t *counter, uint64_t n){
+
+#ifdef MM_THREADS
+    __atomic_fetch_sub(counter, n, __ATOMIC_RELAXED);
+#else
+    *counter -= n;
+#endif
+}
+
+/*
+ * stat_in_use:bytes of heap blocks in use,slabs and arena chunks included
+ *             everything in the heap that is not free or a boundary tag
+ */
+static size_t stat_in_use(void){
+
+    return stats.heap_size - 16 - stats.free_bytes - stats.quick_bytes;
+}
+
+/*
+ * stat_peak:remember the heap usage if it is the highest so far
+ */
+static void stat_peak(void){
+
+    size_t in_use = stat_in_use();
+
+    if (in_use > stats.peak_in_use){
+        stats.peak_in_use = in_use;
+    }
+}
+
+/*
+ * largest_free:the biggest free block,or null if there is none
+ *
+ * the rightmost tree node when the tree has any;otherwise only the highest
+ * non-empty list can hold it,so just that list is scanned
+ */
+static block_t *largest_free(void){
+
+    size_t fl, sl;
+    block_t *block, *best = NULL;
+
+    if (tree_root){
+        for (block = tree_root; tree_node(block)->child[1];
+             block = tree_node(block)->child[1]);
+        return block;
+    }
+    if (!fl_bitmap){
+        return NULL;
+    }
+    fl = 63 - __builtin_clzll(fl_bitmap);
+    sl = 31 - __builtin_clz(sl_bitmap[fl]);
+    for (block = free_lists[fl][sl]; block; block = get_next_free(block)){
+        if (!best || get_size(block) > get_size(best)){
+            best = block;
+        }
+    }
+    return best;
+}
+
+/*
+ * arena_grow:make room for size more bytes at arena->cur
+ *
+ * first try to extend the head chunk in place,keeping the arena one
+ * block;otherwise start a new chunk and leave the old tail unused
+ * return false if the heap cannot grow
+ */
+static bool arena_grow(mm_arena_t *arena, size_t size){
+
+    arena_chunk_t *chunk = arena->chunks;
+    size_t grow = max(size, arena->chunk_size);
+    size_t used = chunk ? (size_t)(arena->cur - (char *)chunk) : 0;
+    bool ok = true;
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+#endif
+    if (chunk != NULL && resize_in_place(chunk, used + grow)){
+        chunk->end = (char *)chunk + usable_size(chunk);
+    }else if ((chunk = block_malloc(sizeof(arena_chunk_t) + grow)) != NULL){
+        chunk->next = arena->chunks;
+        chunk->end = (char *)chunk + usable_size(chunk);
+        arena->chunks = chunk;
+        arena->cur = chunk->data;
+    }else{
+        ok = false;
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    return ok;
+}
+
+/*
+ * prof_malloc:the byte countdown ran out;start a new one and,if sampling
+ *             is on,serve size from a mapping and record its stack
+ *
+ * a dump asked for by a signal is written here instead.return null for
+ * the caller to allocate as usual:no sample,this thread is in the
+ * profiler already,the heap is not set up yet or the mapping failed
+ * kept out of line so the stack always starts with it and its caller
+ */
+__attribute__((noinline))
+static void *prof_malloc(size_t size){
+
+    void *stack[PROF_DEPTH + 2];
+    void *bp = NULL;
+    int depth;
+    size_t rate = __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+
+    prof_left = prof_next(rate);
+    if (prof_busy || heap_start == NULL){
+        return NULL;
+    }
+    prof_busy = true;
+    if (prof_dump_pending){
+        prof_dump_file();
+    }else if (rate != 0 && (bp = mmap_malloc(size)) != NULL){
+        // drop prof_malloc and malloc/calloc,the caller is what we want
+        depth = backtrace(stack, PROF_DEPTH + 2);
+        prof_record(payload_to_header(bp), size, stack + 2,
+                    depth > 2 ? depth - 2 : 0);
+    }
+    prof_busy = false;
+    return bp;
+}
+
+/*
+ * prof_record:count a sample of size bytes at stack,and mark block
+ *             as sampled;without memory for the table it stays unmarked
+ */
+static void prof_record(block_t *block, size_t size, void **stack, int depth){
+
+    prof_bucket_t *bucket;
+    prof_sample_t *sample = NULL;
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&prof_lock);
+#endif
+    if ((bucket = prof_bucket(stack, depth)) != NULL){
+        if ((sample = prof_free_samples) != NULL){
+            prof_free_samples = sample->next;
+        }else{
+            sample = prof_alloc(sizeof(prof_sample_t));
+        }
+    }
+    if (sample != NULL){
+        sample->bucket = bucket;
+        sample->size = size;
+        bucket->live_count += 1;
+        bucket->live_bytes += size;
+        bucket->alloc_count += 1;
+        bucket->alloc_bytes += size;
+        *prof_slot(block) = sample;
+        write_bit(block, fourth_bit_mask);
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&prof_lock);
+#endif
+}
+
+/*
+ * prof_forget:take the sample of block,which is being freed,out of
+ *             the live counts;return true if its mapping is one page
+ *             and was kept for prof_page instead of being unmapped
+ *
+ * most samples are small,so this saves the next sample a mapping,
+ * its page fault and the unmap
+ */
+static bool prof_forget(block_t *block){
+
+    prof_sample_t *sample = *prof_slot(block);
+    void **base = (void **)prof_slot(block);
+    bool kept = false;
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&prof_lock);
+#endif
+    sample->bucket->live_count -= 1;
+    sample->bucket->live_bytes -= sample->size;
+    sample->next = prof_free_samples;
+    prof_free_samples = sample;
+    if (get_size(block) + 16 == page_size && prof_npages < PROF_PAGES){
+        *base = prof_pages;
+        prof_pages = base;
+        prof_npages += 1;
+        kept = true;
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&prof_lock);
+#endif
+    return kept;
+}
+
+/*
+ * prof_page:a zeroed page kept by prof_forget,null if there is none
+ */
+static char *prof_page(void){
+
+    char *base;
+
+    if (__atomic_load_n(&prof_npages, __ATOMIC_RELAXED) == 0){
+        return NULL;
+    }
+#ifdef MM_THREADS
+    pthread_mutex_lock(&prof_lock);
+#endif
+    if ((base = prof_pages) != NULL){
+        prof_pages = *(void **)base;
+        prof_npages -= 1;
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&prof_lock);
+#endif
+    if (base != NULL){
+        memset(base, 0, page_size);     // like a fresh mapping
+    }
+    return base;
+}
+
+/*
+ * prof_bucket:find or add the bucket of a stack,null if there is no
+ *             memory left for a new one;caller holds prof_lock
+ *
+ * buckets are never freed,the alloc counts of a stack outlive its
+ * last live sample
+ */
+static prof_bucket_t *prof_bucket(void **stack, int depth){
+
+    uint32_t hash = 2166136261u;    // FNV-1a over the addresses
+    prof_bucket_t *bucket;
+    int i;
+
+    for (i = 0; i < depth; i++){
+        hash = (hash ^ (uint32_t)((uintptr_t)stack[i] >> 2)) * 16777619u;
+    }
+    for (bucket = prof_buckets[hash % PROF_BUCKETS]; bucket;
+         bucket = bucket->next){
+        if (bucket->hash == hash && bucket->depth == (uint32_t)depth
+                && !memcmp(bucket->stack, stack, depth * sizeof(void *))){
+            return bucket;
+        }
+    }
+    if ((bucket = prof_alloc(sizeof(prof_bucket_t))) == NULL){
+        return NULL;
+    }
+    bucket->hash = hash;
+    bucket->depth = depth;
+    memcpy(bucket->stack, stack, depth * sizeof(void *));
+    bucket->next = prof_buckets[hash % PROF_BUCKETS];
+    // complete before mm_prof_dump can see it
+    __atomic_store_n(&prof_buckets[hash % PROF_BUCKETS], bucket,
+                     __ATOMIC_RELEASE);
+    return bucket;
+}
+
+/*
+ * prof_counts:live samples,live bytes,samples and bytes of a bucket,
+ *             read without prof_lock
+ */
+static void prof_counts(prof_bucket_t *bucket, uint64_t *count){
+
+    count[0] = __atomic_load_n(&bucket->live_count, __ATOMIC_RELAXED);
+    count[1] = __atomic_load_n(&bucket->live_bytes, __ATOMIC_RELAXED);
+    count[2] = __atomic_load_n(&bucket->alloc_count, __ATOMIC_RELAXED);
+    count[3] = __atomic_load_n(&bucket->alloc_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * prof_alloc:size bytes of zeroed profiler memory,null if none is left
+ *            caller holds prof_lock
+ *
+ * straight from mmap,so the profiler never allocates through malloc
+ */
+static void *prof_alloc(size_t size){
+
+    void *bp;
+
+    size = round_up(size, 16);
+    if (prof_pool_left < size){
+        bp = mmap(NULL, prof_pool_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (bp == MAP_FAILED){
+            return NULL;
+        }
+        prof_pool = bp;
+        prof_pool_left = prof_pool_size;
+    }
+    bp = prof_pool;
+    prof_pool += size;
+    prof_pool_left -= size;
+    return bp;
+}
+
+/*
+ * prof_slot:where a sampled mapping keeps its sample,in front of the header
+ */
+static prof_sample_t **prof_slot(block_t *block){
+
+    return (prof_sample_t **)((char *)block - (16 - wsize));
+}
+
+/*
+ * prof_next:bytes until the next sample,drawn from an exponential
+ *           distribution with mean rate;prof_idle when sampling is off
+ *
+ * -ln(u) for u uniform in (0,1],with ln from the exponent of u and an
+ * atanh series on its mantissa,so no libm is needed
+ */
+static size_t prof_next(size_t rate){
+
+    union { double d; uint64_t bits; } u;
+    uint64_t x;
+    int e;
+    double t, t2, ln;
+
+    if (rate == 0){
+        return prof_idle;
+    }
+    if (prof_seed == 0){
+        // differs between threads
+        prof_seed = ((uintptr_t)&prof_seed | 1) * 0x9E3779B97F4A7C15u;
+    }
+    x = prof_seed;      // xorshift64
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    prof_seed = x;
+
+    u.d = (double)((x >> 11) + 1) / 9007199254740992.0;    // 2^53
+    e = (int)((u.bits >> 52) & 0x7ff) - 1023;
+    u.bits = (u.bits & 0xfffffffffffffu) | 0x3ff0000000000000u; // in [1,2)
+    t = (u.d - 1) / (u.d + 1);
+    t2 = t*t;
+    ln = e * 0.6931471805599453
+         + 2*t*(1 + t2*(1.0/3 + t2*(1.0/5 + t2*(1.0/7 + t2/9))));
+    return (size_t)(-ln * rate) + 1;
+}
+
+/*
+ * prof_handler:signal handler of mm_prof_signal,make the interrupted
+ *              thread's next malloc reach prof_malloc
+ */
+static void prof_handler(int signo){
+
+    (void)signo;
+    prof_dump_pending = 1;
+    prof_left = 0;
+}
+
+/*
+ * prof_dump_file:write the dump a signal asked for
+ */
+static void prof_dump_file(void){
+
+    char name[sizeof(prof_path) + 32];
+    FILE *fp;
+
+    prof_dump_pending = 0;
+    snprintf(name, sizeof(name), "%s.%d.%u.heap", prof_path, (int)getpid(),
+             __atomic_add_fetch(&prof_dumps, 1, __ATOMIC_RELAXED));
+    if ((fp = fopen(name, "w")) != NULL){
+        mm_prof_dump(fp);
+        fclose(fp);
+    }
+}
+
+/*
+ * prof_maps:append the memory map of the process to a profile
+ */
+static void prof_maps(FILE *fp){
+
+    char buf[4096];
+    size_t n;
+    FILE *maps = fopen("/proc/self/maps", "r");
+
+    fputs("\nMAPPED_LIBRARIES:\n", fp);
+    if (maps == NULL){
+        return;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), maps)) > 0){
+        fwrite(buf, 1, n, fp);
+    }
+    fclose(maps);
+}
+
+#ifdef MM_THREADS
+/*
+ * tcache_malloc:thread-safe malloc
+ *
+ * pop a cached slot of the size class if there is one,
+ * refill the class in a batch when it is empty;
+ * large requests go straight to the heap under the lock
+ */
+static void *tcache_malloc(size_t size){
+
+    void *bp;
+    size_t index = (size-1)/16;
+
+    if (size == 0 || size > slab_max){
+        pthread_mutex_lock(&heap_lock);
+        tcache_flush_stats();
+        bp = heap_malloc(size);
+        pthread_mutex_unlock(&heap_lock);
+        return bp;
+    }
+
+    if (!tcache.head[index]){
+        tcache_refill(index);
+        if (!tcache.head[index]){
+            return NULL;
+        }
+    }
+
+    bp = tcache.head[index];
+    tcache.head[index] = *(void **)bp;
+    tcache.count[index] -= 1;
+    return bp;
+}
+
+/*
+ * tcache_free:thread-safe free,size is the requested size or 0
+ *
+ * push slab slots onto the cache of their size class and drain
+ * a batch back to the slabs once the class holds TCACHE_MAX slots
+ * a slot of another thread's heap goes on that heap's remote list
+ * slab_map bits of live slots never change,so the lookup needs no lock
+ * a known size gives the class directly,realloc keeps a slot's size in
+ * its class;a known size above slab_max skips the lookup
+ */
+static void tcache_free(void *bp, size_t size){
+
+    slab_t *slab;
+    size_t index;
+
+    if (bp == NULL){
+        return;
+    }
+
+    if (size > slab_max || (slab = find_slab(bp)) == NULL){
+        // a small size skips the header read;a sampled small block is
+        // still a mapping,heap_free unmaps it under the lock
+        if ((size == 0 || size > slab_max)
+                && read_bit(payload_to_header(bp), 3)){
+            mmap_free(payload_to_header(bp));
+            return;
+        }
+        pthread_mutex_lock(&heap_lock);
+        tcache_flush_stats();
+        heap_free(bp);
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+
+    if (slab->heap != tcache.heap && slab->heap != &shared_slabs){
+        slab_remote_free(slab->heap, bp);
+        return;
+    }
+    index = (size > 0 && size <= slab_max) ? (size-1)/16 : slab->index;
+    if (tcache.count[index] >= TCACHE_MAX){
+        tcache_drain(index, TCACHE_BATCH);
+    }
+    *(void **)bp = tcache.head[index];
+    tcache.head[index] = bp;
+    tcache.count[index] += 1;
+}
+
+/*
+ * tcache_refill:move TCACHE_BATCH slots of class index into the cache
+ *
+ * take back what other threads freed to this thread's heap first,then
+ * cut slots from its own slabs without a lock;only a heap that cannot
+ * be made or grown falls back to one lock round trip on the shared slabs
+ */
+static void tcache_refill(size_t index){
+
+    size_t i;
+    void *bp;
+    size_t size = (index+1)*16;
+
+    tcache_register();
+    if (!tcache.heap){
+        tcache.heap = tcache_heap();
+    }
+    if (tcache.heap){
+        pthread_mutex_lock(&tcache.heap->lock);
+        tcache_collect();
+        for (i = tcache.count[index]; i < TCACHE_BATCH; i++){
+            if ((bp = slab_malloc(tcache.heap, size)) == NULL){
+                break;
+            }
+            *(void **)bp = tcache.head[index];
+            tcache.head[index] = bp;
+            tcache.count[index] += 1;
+        }
+        pthread_mutex_unlock(&tcache.heap->lock);
+        if (tcache.head[index]){
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    tcache_flush_stats();
+    for (i = 0; i < TCACHE_BATCH; i++){
+        if ((bp = heap_malloc(size)) == NULL){
+            break;
+        }
+        *(void **)bp = tcache.head[index];
+        tcache.head[index] = bp;
+        tcache.count[index] += 1;
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * tcache_collect:take the whole remote list of this thread's heap,
+ *                cache what fits and give the rest back to its slabs
+ *                caller holds the lock of the heap
+ */
+static void tcache_collect(void){
+
+    void *bp, *next;
+    size_t index;
+
+    bp = __atomic_exchange_n(&tcache.heap->remote, NULL, __ATOMIC_ACQUIRE);
+    for (; bp; bp = next){
+        next = *(void **)bp;
+        index = find_slab(bp)->index;
+        if (tcache.count[index] < TCACHE_MAX){
+            *(void **)bp = tcache.head[index];
+            tcache.head[index] = bp;
+            tcache.count[index] += 1;
+        }else{
+            slab_free(find_slab(bp), bp);
+        }
+    }
+}
+
+/*
+ * tcache_heap:adopt the heap of an exited thread or make a new one
+ *
+ * return null if the heap cannot hold one
+ */
+static slab_heap_t *tcache_heap(void){
+
+    slab_heap_t *heap;
+
+    pthread_mutex_lock(&heap_lock);
+    tcache_flush_stats();
+    if (heap_start == NULL){
+        mm_init();
+    }
+    for (heap = thread_heaps; heap; heap = heap->next){
+        if (heap->abandoned){
+            heap->abandoned = false;
+            break;
+        }
+    }
+    if (!heap && (heap = block_malloc_aligned(64, sizeof(slab_heap_t)))){
+        memset(heap, 0, sizeof(slab_heap_t));
+        pthread_mutex_init(&heap->lock, NULL);
+        heap->next = thread_heaps;
+        // fork_prepare walks the list before it holds heap_lock
+        __atomic_store_n(&thread_heaps, heap, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return heap;
+}
+
+/*
+ * tcache_drain:return up to n cached slots of class index to their slabs
+ *
+ * slots of this thread's heap only need its lock,the rest take heap_lock
+ * once
+ */
+static void tcache_drain(size_t index, unsigned n){
+
+    void *bp;
+    void *other = NULL;
+    slab_t *slab;
+
+    if (tcache.heap){
+        pthread_mutex_lock(&tcache.heap->lock);
+    }
+    while (n > 0 && (bp = tcache.head[index])){
+        tcache.head[index] = *(void **)bp;
+        tcache.count[index] -= 1;
+        n--;
+        if ((slab = find_slab(bp))->heap == tcache.heap){
+            slab_free(slab, bp);
+        }else{
+            *(void **)bp = other;
+            other = bp;
+        }
+    }
+    if (tcache.heap){
+        pthread_mutex_unlock(&tcache.heap->lock);
+    }
+    if (!other){
+        return;
+    }
+    pthread_mutex_lock(&heap_lock);
+    tcache_flush_stats();
+    for (bp = other; bp; bp = other){
+        other = *(void **)bp;
+        heap_free(bp);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * tcache_register:install the exit destructor for the calling thread
+ *                 so its cache goes back to the heap when it exits
+ */
+static void tcache_register(void){
+
+    if (tcache.registered){
+        return;
+    }
+    // set first:pthread_setspecific may allocate,and that malloc
+    // comes back here when mm.c is the process allocator
+    tcache.registered = true;
+    pthread_once(&tcache_once, tcache_make_key);
+    pthread_setspecific(tcache_key, &tcache);
+}
+
+/*
+ * tcache_make_key:create the key whose destructor drains thread caches
+ */
+static void tcache_make_key(void){
+
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * tcache_destroy:drain every class of an exiting thread's cache and
+ *                leave its heap to the next thread that needs one
+ *
+ * slots freed to the heap after this wait on its remote list
+ */
+static void tcache_destroy(void *arg){
+
+    size_t i;
+
+    (void)arg;
+    if (tcache.heap){
+        pthread_mutex_lock(&tcache.heap->lock);
+        tcache_collect();
+        pthread_mutex_unlock(&tcache.heap->lock);
+    }
+    for (i = 0; i < TCACHE_CLASSES; i++){
+        tcache_drain(i, TCACHE_MAX);
+    }
+    if (tcache.heap){
+        pthread_mutex_lock(&heap_lock);
+        tcache.heap->abandoned = true;
+        pthread_mutex_unlock(&heap_lock);
+        tcache.heap = NULL;
+    }
+    tcache.registered = false;
+}
+
+/*
+ * tcache_flush_stats:add the calls this thread counted to stats
+ *                    caller holds heap_lock
+ */
+static void tcache_flush_stats(void){
+
+    stats.mallocs += tcache.mallocs;
+    stats.frees += tcache.frees;
+    stats.callocs += tcache.callocs;
+    tcache.mallocs = tcache.frees = tcache.callocs = 0;
+}
+
+#ifndef DRIVER
+/*
+ * fork_register:run before main,make fork() hold the locks across the
+ *               copy so the child starts with a consistent,unlocked heap
+ *
+ * the child only keeps the cache of the thread that forked;slots cached
+ * by the other threads stay allocated there,and their heaps are left
+ * for threads of the child to adopt.every thread heap is locked too,so
+ * none is copied halfway through a change by its owner
+ */
+__attribute__((constructor))
+static void fork_register(void){
+
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/*
+ * fork_prepare:lock the thread heaps,then heap_lock and prof_lock
+ *
+ * heap locks come before heap_lock,so the list is walked without it;
+ * heaps only ever get pushed on its front,and any that came in before
+ * heap_lock was taken are locked on another round
+ */
+static void fork_prepare(void){
+
+    slab_heap_t *heap, *head;
+    slab_heap_t *locked = NULL;
+
+    for (;;){
+        head = __atomic_load_n(&thread_heaps, __ATOMIC_ACQUIRE);
+        for (heap = head; heap != locked; heap = heap->next){
+            pthread_mutex_lock(&heap->lock);
+        }
+        locked = head;
+        pthread_mutex_lock(&heap_lock);
+        if (thread_heaps == locked){
+            break;
+        }
+        pthread_mutex_unlock(&heap_lock);
+    }
+    pthread_mutex_lock(&prof_lock);
+}
+
+static void fork_parent(void){
+
+    slab_heap_t *heap;
+
+    for (heap = thread_heaps; heap; heap = heap->next){
+        pthread_mutex_unlock(&heap->lock);
+    }
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void fork_child(void){
+
+    slab_heap_t *heap;
+
+    for (heap = thread_heaps; heap; heap = heap->next){
+        heap->abandoned = (heap != tcache.heap);
+        pthread_mutex_init(&heap->lock, NULL);
+    }
+    pthread_mutex_init(&heap_lock, NULL);
+    pthread_mutex_init(&prof_lock, NULL);
+}
+#endif /* ndef DRIVER */
+#endif
+
+/*
+ * quick_free:keep a freed small block for the next request of its size
+ *
+ * the block stays marked allocated,so it is neither coalesced nor split;
+ * a quick list that grows past QUICK_MAX goes back to the free lists
+ * caller holds heap_lock in thread-safe mode
+ */
+static void quick_free(block_t *block){
+
+    size_t index = (get_size(block) - min_block_size)/16;
+
+    if (hardened){
+        write_bit(block, fourth_bit_mask);  // a second free finds it
+    }
+    *(block_t **)header_to_payload(block) = quick_lists[index];
+    quick_lists[index] = block;
+    quick_count[index] += 1;
+    quick_total += 1;
+    stats.quick_bytes += get_size(block);
+
+    if (quick_count[index] > QUICK_MAX){
+        quick_flush_class(index);
+    }
+}
+
+/*
+ * quick_malloc:pop a quick block of exactly asize bytes,null if none
+ */
+static block_t *quick_malloc(size_t asize){
+
+    size_t index = (asize - min_block_size)/16;
+    block_t *block = quick_lists[index];
+
+    if (block){
+        check_quick(block);
+        quick_lists[index] = *(block_t **)header_to_payload(block);
+        quick_count[index] -= 1;
+        quick_total -= 1;
+        stats.quick_bytes -= asize;
+    }
+    return block;
+}
 
-    // Free the old block
-    free(ptr);
+/*
+ * quick_flush_class:free every block of one quick list for real,
+ *                   coalescing it with its free neighbours
+ */
+static void quick_flush_class(size_t index){
 
-    return newptr;
+    block_t *block;
+
+    while ((block = quick_lists[index])){
+        check_quick(block);
+        quick_lists[index] = *(block_t **)header_to_payload(block);
+        quick_total -= 1;
+        stats.quick_bytes -= get_size(block);
+        block_free(header_to_payload(block));
+    }
+    quick_count[index] = 0;
 }
 
 /*
- * calloc:allocate memory for an array and return a pointer
- *                 to the allocated memory
+ * quick_flush:empty all quick lists into the free lists
+ */
+static void quick_flush(void){
+
+    size_t i;
+
+    for (i = 0; i < QUICK_CLASSES && quick_total > 0; i++){
+        quick_flush_class(i);
+    }
+}
+
+/*
+ * slab_malloc:take a free slot from a slab of heap of the size class
  *
- * the memory is set to 0 before returning
- * source reference:mm-baseline.c
+ * use the first partial slab (making a new one if there is none)
+ * and its lowest free slot;a full slab leaves the partial list
+ * return null if no slab could be made
  */
-void *calloc(size_t elements, size_t size)
-{
-    void *bp;
-    size_t asize = elements * size;
+static void *slab_malloc(slab_heap_t *heap, size_t size){
 
-    if (asize/elements != size)
-    // Multiplication overflowed
-    return NULL;
-    
-    bp = malloc(asize);
-    if (bp == NULL)
-    {
+    size_t i, bit;
+    size_t index = (size-1)/16;
+    slab_t *slab = heap->partial[index];
+
+    if (!slab && (slab = slab_new(heap, index)) == NULL){
         return NULL;
     }
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
 
-    return bp;
+    for (i = 0; !slab->bitmap[i]; i++);
+    bit = __builtin_ctzll(slab->bitmap[i]);
+    slab->bitmap[i] &= ~((uint64_t)1 << bit);
+    slab->nfree -= 1;
+
+    if (slab->nfree == 0){
+        slab_unlink(slab);
+    }
+    return slab->slots + (i*64 + bit)*(index+1)*16;
 }
 
+/*
+ * slab_free:give the slot bp back to its slab in constant time
+ *
+ * a slab that was full goes back on the partial list;an empty slab
+ * is returned to the heap unless it is the only partial one of its class
+ * caller is the owner of the slab (holds heap_lock for shared_slabs)
+ */
+static void slab_free(slab_t *slab, void *bp){
+
+    size_t slot = ((char *)bp - slab->slots) / ((slab->index+1)*16);
 
-/******** The remaining content below are helper and debug routines ********/
+    dbg_requires(!(slab->bitmap[slot/64] & ((uint64_t)1 << (slot%64))));
+    slab->bitmap[slot/64] |= (uint64_t)1 << (slot%64);
+    slab->nfree += 1;
+
+    if (slab->nfree == 1){
+        slab->prev = NULL;
+        slab->next = slab->heap->partial[slab->index];
+        if (slab->next){
+            slab->next->prev = slab;
+        }
+        slab->heap->partial[slab->index] = slab;
+
+    }else if (slab->nfree == slab->nslots
+              && (slab->next || slab->prev)){
+        slab_unlink(slab);
+        slab_map_set(slab, false);
+        if (slab->in_segment){
+            segment_put(slab);
+        }else{
+            slab_heap_lock(slab->heap);
+            block_free(slab);
+            slab_heap_unlock(slab->heap);
+        }
+    }
+}
+
+/*
+ * slab_remote_free:give slot bp back to the thread heap that owns it
+ *                  without a lock,its owner frees it later
+ *
+ * a push on a list that only the owner takes from,and then all of it,
+ * so a node cannot come back to the head while a push is looking at it
+ */
+static void slab_remote_free(slab_heap_t *heap, void *bp){
+
+    void *head = __atomic_load_n(&heap->remote, __ATOMIC_RELAXED);
+
+    do {
+        *(void **)bp = head;
+    } while (!__atomic_compare_exchange_n(&heap->remote, &head, bp, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * slab_new:take a page of a segment for a slab of class index,or carve
+ *          a page-aligned one from the heap,and put it on the partial
+ *          list of heap
+ *
+ * return null if the heap cannot grow or the page lies past slab_map
+ */
+static slab_t *slab_new(slab_heap_t *heap, size_t index){
+
+    size_t i;
+    size_t slot_size = (index+1)*16;
+    slab_t *slab = NULL;
+
+    if (slab_segments){
+        slab = segment_take(heap);
+    }
+    if (slab){
+        slab->in_segment = true;
+    }else{
+        slab_heap_lock(heap);
+        slab = block_malloc_aligned(slab_size, slab_size);
+        if (slab && ((uintptr_t)slab >> slab_page_shift) - slab_base_page
+                >= SLAB_MAP_PAGES){
+            block_free(slab);
+            slab = NULL;
+        }
+        slab_heap_unlock(heap);
+        if (!slab){
+            return NULL;
+        }
+        slab->in_segment = false;
+    }
+
+    slab->heap = heap;
+    slab->index = index;
+    slab->nslots = (slab_size - offsetof(slab_t, slots)) / slot_size;
+    slab->nfree = slab->nslots;
+    for (i = 0; i < 4; i++){
+        if (slab->nslots >= (i+1)*64){
+            slab->bitmap[i] = ~(uint64_t)0;
+        }else if (slab->nslots > i*64){
+            slab->bitmap[i] = ((uint64_t)1 << (slab->nslots - i*64)) - 1;
+        }else{
+            slab->bitmap[i] = 0;
+        }
+    }
+
+    slab->prev = NULL;
+    slab->next = heap->partial[index];
+    if (slab->next){
+        slab->next->prev = slab;
+    }
+    heap->partial[index] = slab;
+    slab_map_set(slab, true);
+    return slab;
+}
+
+/*
+ * find_slab:return the slab holding bp,or null if bp is a block payload
+ *
+ * pointers outside the heap map to pages past slab_map
+ */
+static slab_t *find_slab(void *bp){
+
+    uintptr_t page = ((uintptr_t)bp >> slab_page_shift) - slab_base_page;
+
+    if (page < SLAB_MAP_PAGES
+            && (slab_map[page/64] >> (page%64)) & 1){
+        return (slab_t *)((page + slab_base_page) << slab_page_shift);
+    }
+    return NULL;
+}
+
+/*
+ * slab_map_set:mark or clear the page of slab in slab_map
+ *
+ * atomic in thread-safe mode,thread heaps change their bits unlocked
+ */
+static void slab_map_set(slab_t *slab, bool set){
+
+    uintptr_t page = ((uintptr_t)slab >> slab_page_shift) - slab_base_page;
+    uint64_t bit = (uint64_t)1 << (page%64);
+
+#ifdef MM_THREADS
+    if (set){
+        __atomic_fetch_or(&slab_map[page/64], bit, __ATOMIC_RELAXED);
+    }else{
+        __atomic_fetch_and(&slab_map[page/64], ~bit, __ATOMIC_RELAXED);
+    }
+#else
+    if (set){
+        slab_map[page/64] |= bit;
+    }else{
+        slab_map[page/64] &= ~bit;
+    }
+#endif
+}
+
+/*
+ * slab_unlink:remove slab from the partial list of its class
+ */
+static void slab_unlink(slab_t *slab){
+
+    if (slab->prev){
+        slab->prev->next = slab->next;
+    }else{
+        slab->heap->partial[slab->index] = slab->next;
+    }
+    if (slab->next){
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/*
+ * segment_take:return a free page of a segment of heap for a new slab
+ *
+ * use the first segment with free pages and its lowest one,or make
+ * a segment from the heap;a segment without free pages leaves the list
+ * return null if no segment could be made
+ */
+static slab_t *segment_take(slab_heap_t *heap){
+
+    size_t i, bit;
+    segment_t *segment = heap->segments;
+
+    if (!segment){
+        slab_heap_lock(heap);
+        segment = block_malloc_aligned(segment_size, segment_size);
+        if (segment && ((uintptr_t)segment >> slab_page_shift)
+                - slab_base_page > SLAB_MAP_PAGES - SEGMENT_PAGES){
+            block_free(segment);
+            segment = NULL;
+        }
+        slab_heap_unlock(heap);
+        if (!segment){
+            return NULL;
+        }
+        segment->heap = heap;
+        segment->nfree = SEGMENT_PAGES - 1;
+        for (i = 0; i < SEGMENT_PAGES/64; i++){
+            segment->free_map[i] = ~(uint64_t)0;
+        }
+        segment->free_map[0] &= ~(uint64_t)1;   // the header
+        segment->prev = NULL;
+        segment->next = NULL;
+        heap->segments = segment;
+    }
+
+    for (i = 0; !segment->free_map[i]; i++);
+    bit = __builtin_ctzll(segment->free_map[i]);
+    segment->free_map[i] &= ~((uint64_t)1 << bit);
+    segment->nfree -= 1;
+
+    if (segment->nfree == 0){
+        segment_unlink(segment);
+    }
+    return (slab_t *)((char *)segment + (i*64 + bit)*slab_size);
+}
+
+/*
+ * segment_put:give the page of an empty slab back to its segment
+ *
+ * a segment that was full goes back on the list;a segment with no slabs
+ * left is returned to the heap unless it is the only one on the list
+ */
+static void segment_put(slab_t *slab){
+
+    segment_t *segment = (segment_t *)((uintptr_t)slab & ~(segment_size-1));
+    size_t page = ((char *)slab - (char *)segment) / slab_size;
+
+    dbg_requires(page > 0);
+    dbg_requires(!(segment->free_map[page/64] & ((uint64_t)1 << (page%64))));
+    segment->free_map[page/64] |= (uint64_t)1 << (page%64);
+    segment->nfree += 1;
+
+    if (segment->nfree == 1){
+        segment->prev = NULL;
+        segment->next = segment->heap->segments;
+        if (segment->next){
+            segment->next->prev = segment;
+        }
+        segment->heap->segments = segment;
+
+    }else if (segment->nfree == SEGMENT_PAGES - 1
+              && (segment->next || segment->prev)){
+        segment_unlink(segment);
+        slab_heap_lock(segment->heap);
+        block_free(segment);
+        slab_heap_unlock(segment->heap);
+    }
+}
+
+/*
+ * segment_unlink:remove segment from the list of segments with free pages
+ */
+static void segment_unlink(segment_t *segment){
+
+    if (segment->prev){
+        segment->prev->next = segment->next;
+    }else{
+        segment->heap->segments = segment->next;
+    }
+    if (segment->next){
+        segment->next->prev = segment->prev;
+    }
+    segment->next = NULL;
+    segment->prev = NULL;
+}
+
+/*
+ * slab_heap_lock/slab_heap_unlock:take heap_lock around the shared heap
+ *                                 for a thread heap;shared_slabs is only
+ *                                 used under it already
+ */
+static void slab_heap_lock(slab_heap_t *heap){
+
+#ifdef MM_THREADS
+    if (heap != &shared_slabs){
+        pthread_mutex_lock(&heap_lock);
+        tcache_flush_stats();
+    }
+#else
+    (void)heap;
+#endif
+}
+
+static void slab_heap_unlock(slab_heap_t *heap){
+
+#ifdef MM_THREADS
+    if (heap != &shared_slabs){
+        pthread_mutex_unlock(&heap_lock);
+    }
+#else
+    (void)heap;
+#endif
+}
 
 /*
  * extend_heap:extending heap space when needed
@@ -360,18 +3197,25 @@ static block_t *extend_heap(size_t size){
 
     // Allocate an even number of words to maintain alignment
     size = round_up(size,16);
+    // keep every block and link offset below block_max
+    if (size > block_max - mem_heapsize()){
+        return NULL;
+    }
     if ((bp = mem_sbrk(size)) == (void *)-1){
         return NULL;
     }
+    stats.extends += 1;
+    stats.heap_size += size;
 
     // Initialize free block header/footer
     block_t *block = payload_to_header(bp);
     size_t second_bit = read_bit(block, 2);
-    size_t third_bit = read_bit(block, 3);
     write_header(block, size, false);
     write_footer(block, size, false);
-    write_bit(block, third_bit);
     write_bit(block, second_bit);
+    if (sbrk_zeroed){
+        write_bit(block, third_bit_mask);
+    }
     // Create new epilogue header
     block_t *block_next = find_next(block);
     write_header(block_next, 0, true);
@@ -394,6 +3238,8 @@ static block_t *extend_heap(size_t size){
  *         header:previous block;footer:current block
  * case 4: three blocks are merged,size combined
  *         header:previous block;footer:next block
+ * the result is known-zero when every merged block was;then the
+ * headers,footers and pointers left inside it are cleared as well
  */
 static block_t *coalesce(block_t * block){
 
@@ -403,233 +3249,472 @@ static block_t *coalesce(block_t * block){
     size_t prev_alloc = read_bit(block, 2);
     size_t next_alloc = get_alloc(block_next); 
     size_t size = get_size(block);
-
-    if (read_bit(block,3)){
-        block_prev = (block_t *)((char*)block - dsize);
-    }
+    bool zero = read_bit(block, 3)
+                && (prev_alloc || read_bit(block_prev, 3))
+                && (next_alloc || read_bit(block_next, 3));
+    // footer before,header and links of a block that ends up inside
+    size_t inner = wsize + wsize + link_size(size);
+    size_t inner_next = next_alloc ? 0 : 2*wsize + link_size(get_size(block_next));
 
     if (prev_alloc && next_alloc){ // Case 1
 
         insert_list(block);
         free_bit(block_next, 2);
-        if (size == min_block_size){
-            write_bit(block_next, third_bit_mask);
-        }
         return block;
 
     }else if (prev_alloc && !next_alloc){ // Case 2
+        stats.coalesces += 1;
         size += get_size(block_next);
         remove_list(block_next);
         free_bit(find_next(block_next), 2);
-        write_bit(block, prev_alloc);
         write_header(block, size, false);
+        write_bit(block, prev_alloc);
         write_footer(block_next, size, false);
+        if (zero){
+            memset((char *)block_next - wsize, 0, inner_next);
+        }
 
     }else if (!prev_alloc && next_alloc){ // Case 3     
+        stats.coalesces += 1;
         size += get_size(block_prev);
         remove_list(block_prev);
         free_bit(block_next, 2);
-        write_bit(block_prev, second_bit_mask);
         write_header(block_prev, size, false);
+        write_bit(block_prev, second_bit_mask);
         write_footer(block, size, false);
+        if (zero){
+            memset((char *)block - wsize, 0, inner);
+        }
         block = block_prev;
         
     }else { // Case 4
+        stats.coalesces += 2;
         size += get_size(block_next) + get_size(block_prev);
         remove_list(block_prev);
         remove_list(block_next);
         free_bit(block_next, 2);
         free_bit(find_next(block_next), 2);
-        write_bit(block_prev, second_bit_mask);
         write_header(block_prev, size, false);   
+        write_bit(block_prev, second_bit_mask);
         write_footer(block_next, size, false); 
+        if (zero){
+            memset((char *)block - wsize, 0, inner);
+            memset((char *)block_next - wsize, 0, inner_next);
+        }
         block = block_prev;
     }
-    insert_list(block);
+    if (zero){
+        write_bit(block, third_bit_mask);
+    }
+    check_absorbed(block);
+    insert_list(block);
+
+    return block;
+}
+
+/*
+ * place:place the asize-block to heap space
+ *
+ * if target block has enough space,split it for asize
+ * else find next appropriate block
+ * need to write previous the header/footer for both cases
+ * the block keeps its own previous-allocated bit,the rest of a
+ * known-zero block stays known-zero
+ */
+static void place(block_t *block, size_t asize){
+    
+    block_t *block_next;
+    size_t csize=get_size(block);
+    size_t prev_alloc=read_bit(block, 2);
+    size_t zero=read_bit(block, 3);
+
+    remove_list(block);
+    if ((csize - asize) >= min_block_size){
+        stats.splits += 1;
+        write_header(block, asize, true);
+        write_bit(block, prev_alloc);
+        block_next = find_next(block);       
+        write_header(block_next, csize-asize, false);  
+        write_footer(block_next, csize-asize, false);
+        write_bit(block_next, second_bit_mask);
+        if (zero){
+            write_bit(block_next, third_bit_mask);
+        }
+        coalesce(block_next);
+    }else{
+        block_next = find_next(block);
+        write_header(block, csize, true);
+        write_bit(block, prev_alloc);
+        write_bit(block_next, second_bit_mask);
+    }
+    canary_set(block);
+    stat_peak();
+
+    return;
+}
+
+/*
+ * find_fit:search the free list for a fit
+ * 
+ * round asize up to the next second-level boundary,so every block of the
+ * first non-empty list at or above it fits;the bitmaps give that list
+ * in constant time. when nothing that large is free,scan the list asize
+ * itself maps to before giving up,since a block there may still fit
+ * blocks of tree_min bytes and up are in the tree instead,which gives
+ * the best fit,lowest address first among equal sizes
+ * return null if no fit found
+ */
+static block_t *find_fit(size_t asize){
+
+    block_t *block;
+    size_t fl, sl;
+    uint64_t fl_map;
+    uint32_t sl_map;
+
+    // the lists only hold blocks below tree_min,so for larger sizes
+    // both searches come up empty and the tree decides
+    mapping_search(asize, &fl, &sl);
+    if (fl < FL_COUNT){
+        sl_map = sl_bitmap[fl] & (~(uint32_t)0 << sl);
+        if (!sl_map){
+            fl_map = (fl + 1 < FL_COUNT) ? fl_bitmap & (~(uint64_t)0 << (fl+1)) : 0;
+            if (fl_map){
+                fl = __builtin_ctzll(fl_map);
+                sl_map = sl_bitmap[fl];
+            }
+        }
+        if (sl_map){
+            return free_lists[fl][__builtin_ctz(sl_map)];
+        }
+    }
+
+    mapping_insert(asize, &fl, &sl);
+    for (block = free_lists[fl][sl]; block; block = get_next_free(block)){
+        if (get_size(block) >= asize){
+            return block;
+        }
+    }
+
+    if ((block = tree_best_fit(asize)) != NULL){
+        return block;
+    }
+
+    // blocks held back in the quick lists may coalesce into a fit
+    if (quick_total > 0){
+        quick_flush();
+        return find_fit(asize);
+    }
+    return NULL; // no fit found
+}
+
+/* 
+ * insert_list:add a block to segregated free list
+ * 
+ * locate the the targeted list based on size and push the block
+ * in front of it (LIFO),then mark the list in both bitmaps
+ */
+static void insert_list(block_t *block){
+
+    stats.free_bytes += get_size(block);
+    stats.free_class[63 - __builtin_clzll(get_size(block))] += get_size(block);
+
+    if (get_size(block) >= tree_min){
+        tree_insert(block);
+        return;
+    }
+
+    //first locate the target list
+    size_t fl, sl;
+    mapping_insert(get_size(block), &fl, &sl);
+    block_t *block_cur = free_lists[fl][sl];
+
+    set_next_free(block, block_cur);
+    set_prev_free(block, NULL);
+    if (block_cur){
+        //update the previous pointer
+        set_prev_free(block_cur, block);
+    }
+    free_lists[fl][sl] = block;
+    fl_bitmap |= (uint64_t)1 << fl;
+    sl_bitmap[fl] |= (uint32_t)1 << sl;
+
+    return;
+}
+
+/* 
+ * remove_list:remove a block in segregated free list
+ * 
+ * unlink the block through its next/prev pointers in constant time,
+ * after checking them in hardened mode
+ * if target block's previous block is null,the block is the list head;
+ * clear the bitmap bits of a list that becomes empty
+ */
+static void remove_list(block_t *block){
+
+    const char *what;
+
+    if (hardened && (what = check_links(block)) != NULL){
+        check_fault(block, what);
+    }
+    stats.free_bytes -= get_size(block);
+    stats.free_class[63 - __builtin_clzll(get_size(block))] -= get_size(block);
+
+    if (get_size(block) >= tree_min){
+        tree_remove(block);
+        return;
+    }
+
+    size_t fl, sl;
+    mapping_insert(get_size(block), &fl, &sl);
+
+    block_t *block_next = get_next_free(block);
+    block_t *block_prev = get_prev_free(block);
+
+    if (block_next){
+        set_prev_free(block_next, block_prev);
+    }
 
-    return block;
+    if (!block_prev){
+        free_lists[fl][sl] = block_next;
+        if (!block_next){
+            sl_bitmap[fl] &= ~((uint32_t)1 << sl);
+            if (!sl_bitmap[fl]){
+                fl_bitmap &= ~((uint64_t)1 << fl);
+            }
+        }
+    }else{
+        set_next_free(block_prev, block_next);
+    }
+    return;
 }
 
 /*
- * place:place the asize-block to heap space
+ * tree_insert:add a free block to the size tree
  *
- * if target block has enough space,split it for asize
- * else find next appropriate block
- * need to write previous the header/footer for both cases
+ * descend by (size,address) to a leaf,link the block there red and
+ * restore the red-black rules on the way back up
  */
-static void place(block_t *block, size_t asize){
-    
-    block_t *block_next;
-    size_t csize=get_size(block);
+static void tree_insert(block_t *block){
 
-    remove_list(block);
-    if ((csize - asize) >= min_block_size){
-        write_header(block, asize, true);
-        write_footer(block, asize, true);          
-        block_next = find_next(block);       
-        write_header(block_next, csize-asize, false);  
-        write_footer(block_next, csize-asize, false);
-        write_bit(block, second_bit_mask);
-        write_bit(block_next, second_bit_mask);
-        coalesce(block_next);
+    block_t *parent = NULL, *grand, *uncle;
+    block_t *cur = tree_root;
+    int dir = 0;
+
+    while (cur){
+        parent = cur;
+        dir = tree_less(cur, block);
+        cur = tree_node(cur)->child[dir];
+    }
+    tree_node(block)->child[0] = NULL;
+    tree_node(block)->child[1] = NULL;
+    tree_node(block)->parent = parent;
+    tree_node(block)->red = true;
+    if (parent){
+        tree_node(parent)->child[dir] = block;
     }else{
-        block_next = find_next(block);
-        write_header(block, csize, true);
-        write_footer(block, csize, true);
-        write_bit(block, second_bit_mask);
-        write_bit(block_next, second_bit_mask);
+        tree_root = block;
     }
 
-    return;
+    while ((parent = tree_node(block)->parent) && tree_red(parent)){
+        grand = tree_node(parent)->parent;   // a red node is never the root
+        dir = (parent == tree_node(grand)->child[1]);
+        uncle = tree_node(grand)->child[!dir];
+        if (tree_red(uncle)){
+            tree_node(parent)->red = false;
+            tree_node(uncle)->red = false;
+            tree_node(grand)->red = true;
+            block = grand;
+            continue;
+        }
+        if (block == tree_node(parent)->child[!dir]){
+            tree_rotate(parent, dir);
+            block = parent;
+            parent = tree_node(block)->parent;
+        }
+        tree_node(parent)->red = false;
+        tree_node(grand)->red = true;
+        tree_rotate(grand, !dir);
+    }
+    tree_node(tree_root)->red = false;
 }
 
 /*
- * find_fit:search the free list for a fit
- * 
- * locate a proper block in the free list according to asize
- * compare the asize to next 8 block sizes and update the info to find a fit 
- * in case splitting the block, return null if no fit found
+ * tree_remove:take a free block out of the size tree
+ *
+ * a block with two children trades places with its successor first,
+ * then removing a black node is repaired by tree_remove_fixup
  */
-static block_t *find_fit(size_t asize){
+static void tree_remove(block_t *block){
 
-    block_t *block;
-    block_t *block_next;
+    block_t *succ, *child, *parent;
+    bool red = tree_node(block)->red;
 
-    size_t i;
-    size_t cur_size,next_size;
-    size_t idx=get_block_offset(asize);
-
-    for (;idx<NUM_LIST;++idx){
-        //first locate target block
-        block = segregated_list[idx];
-        while (block){
-            cur_size = get_size(block);
-            if (asize<=cur_size){
-                //best fit within next 8 blocks
-                block_next = *(block_t **)((char *)block + wsize);
-                for (i=idx;i<idx+8;i++){
-                    if (block_next){
-                        //update to closer block
-                        next_size = get_size(block_next);
-                        if ((asize<=next_size) && (next_size<=cur_size)){
-                            block = block_next;
-                            cur_size = next_size;
-                        }
-                        block_next = *(block_t **)((char *)block_next + wsize);
-                    }
-                }    
-                return block;
-            }
-            block = *(block_t **)((char *)block + wsize);
+    if (!tree_node(block)->child[0] || !tree_node(block)->child[1]){
+        child = tree_node(block)->child[!tree_node(block)->child[0] ? 1 : 0];
+        parent = tree_node(block)->parent;
+        tree_replace(block, child);
+    }else{
+        for (succ = tree_node(block)->child[1]; tree_node(succ)->child[0];
+             succ = tree_node(succ)->child[0]);
+        red = tree_node(succ)->red;
+        child = tree_node(succ)->child[1];
+        if (tree_node(succ)->parent == block){
+            parent = succ;
+        }else{
+            parent = tree_node(succ)->parent;
+            tree_replace(succ, child);
+            tree_node(succ)->child[1] = tree_node(block)->child[1];
+            tree_node(tree_node(succ)->child[1])->parent = succ;
         }
+        tree_replace(block, succ);
+        tree_node(succ)->child[0] = tree_node(block)->child[0];
+        tree_node(tree_node(succ)->child[0])->parent = succ;
+        tree_node(succ)->red = tree_node(block)->red;
+    }
+    if (!red){
+        tree_remove_fixup(child, parent);
     }
-    return NULL; // no fit found
 }
 
-/* 
- * insert_list:add a block to segregated free list
- * 
- * locate the the targeted block in the list based on size
- *
- * 1: block allocated & equal to min block size,update previous pointer
- * else update next pointer
- * 2: block not allocated & equal to min block size,update previous pointer
- * else update next pointer
+/*
+ * tree_remove_fixup:give back the black node that a removal took from
+ *                   the paths through block,whose parent is parent
+ *                   (block may be null)
  */
-static void insert_list(block_t *block){
-
-    //first locate the target block
-    size_t size = get_size(block);
-    size_t index = get_block_offset(size);
-    block_t *block_cur = segregated_list[index];
-
-    if (block_cur){
-        *(block_t **)((char *)block+wsize) = block_cur;
-        //update the next pointer
-        if (size!=min_block_size){  
-            *(block_t **)((char *)block+dsize) = NULL;
-            *(block_t **)((char *)block_cur+dsize) = block;
+static void tree_remove_fixup(block_t *block, block_t *parent){
+
+    block_t *sibling;
+    int dir;
+
+    while (block != tree_root && !tree_red(block)){
+        dir = (block != tree_node(parent)->child[0]);
+        sibling = tree_node(parent)->child[!dir];
+        if (tree_red(sibling)){
+            tree_node(sibling)->red = false;
+            tree_node(parent)->red = true;
+            tree_rotate(parent, dir);
+            sibling = tree_node(parent)->child[!dir];
         }
-    }else{
-        *(block_t **)((char *)block+wsize) = NULL;
-        if (size!=min_block_size){
-            *(block_t **)((char *)block+dsize) = NULL;
+        if (!tree_red(tree_node(sibling)->child[0])
+                && !tree_red(tree_node(sibling)->child[1])){
+            tree_node(sibling)->red = true;
+            block = parent;
+            parent = tree_node(block)->parent;
+            continue;
+        }
+        if (!tree_red(tree_node(sibling)->child[!dir])){
+            tree_node(tree_node(sibling)->child[dir])->red = false;
+            tree_node(sibling)->red = true;
+            tree_rotate(sibling, !dir);
+            sibling = tree_node(parent)->child[!dir];
         }
+        tree_node(sibling)->red = tree_node(parent)->red;
+        tree_node(parent)->red = false;
+        tree_node(tree_node(sibling)->child[!dir])->red = false;
+        tree_rotate(parent, dir);
+        block = tree_root;
+    }
+    if (block){
+        tree_node(block)->red = false;
     }
-    segregated_list[index] = block;
-
-    return;
 }
 
-/* 
- * remove_list:remove a block in segregated free list
- * 
- * locate the the targeted block in the list based on size
- * 1: if size not equal to min block size find next block
- *    else keep looking for a block which fits target block
- * 2: if target block's previous block is null,the block is ahead
- *    else if next block is null, the block is following
+/*
+ * tree_rotate:lift the child of block on side !dir into its place,
+ *             dir 0 rotates left and 1 rotates right
  */
-static void remove_list(block_t *block){
+static void tree_rotate(block_t *block, int dir){
 
-    size_t size = get_size(block);
-    size_t index=get_block_offset(size);
+    block_t *up = tree_node(block)->child[!dir];
+    block_t *inner = tree_node(up)->child[dir];
+
+    tree_node(block)->child[!dir] = inner;
+    if (inner){
+        tree_node(inner)->parent = block;
+    }
+    tree_replace(block, up);
+    tree_node(up)->child[dir] = block;
+    tree_node(block)->parent = up;
+}
+
+/*
+ * tree_replace:put child (maybe null) where block hangs from its parent
+ */
+static void tree_replace(block_t *block, block_t *child){
 
-    block_t *block_prev = NULL;
-    block_t *block_cur = segregated_list[index];
-    block_t *block_next = *(block_t **)((char *)block + wsize);
+    block_t *parent = tree_node(block)->parent;
 
-    if (size!=min_block_size){
-        block_prev = *(block_t **)((char *)block+dsize);
+    if (!parent){
+        tree_root = child;
     }else{
-        //loop until proper block is found
-        while(block_cur!=block){
-            block_prev = block_cur;
-            block_cur = *(block_t **)((char *)block_cur+wsize);
-        }
+        tree_node(parent)->child[block == tree_node(parent)->child[1]] = child;
     }
-    
-    if ((size!=min_block_size)&&(block_next)){
-        *(block_t **)((char *)block_next + dsize) = block_prev;
+    if (child){
+        tree_node(child)->parent = parent;
     }
+}
 
-    if (!block_prev){
-        segregated_list[index] = block_next;
-    }else{
-        *(block_t **)((char *)block_prev + wsize) = block_next;
+/*
+ * tree_best_fit:the smallest free block of at least asize bytes,
+ *               the lowest one among equal sizes;null if none
+ */
+static block_t *tree_best_fit(size_t asize){
+
+    block_t *cur = tree_root, *best = NULL;
+
+    while (cur){
+        if (get_size(cur) >= asize){
+            best = cur;
+            cur = tree_node(cur)->child[0];
+        }else{
+            cur = tree_node(cur)->child[1];
+        }
     }
-    return;
+    return best;
+}
+
+/*
+ * tree_count:number of blocks in the subtree under block
+ */
+static size_t tree_count(block_t *block){
+
+    if (!block){
+        return 0;
+    }
+    return 1 + tree_count(tree_node(block)->child[0])
+             + tree_count(tree_node(block)->child[1]);
 }
 
 /*
  * mm_checkheap:scan the heap and check it for possible error
  *
- * count free blocks,to see if pointers matched
- * segregated list consists of an array of block
- * loop over the list and check each block
+ * check every block with check_block and count the free ones,
+ * segregated lists form a two-level array of lists
+ * loop over the lists and check each block
  * to check if the number of free block matches the number of free list
+ * (and tree),and the quick lists the bytes mm_stats reports for them;
+ * problems are printed with the line of the caller
  */
 bool mm_checkheap(int line){
 
-    printf("checking heap\n");
-
-    size_t i,size;
+    size_t i,j,size;
     size_t free_block = 0;
     block_t *block,*block_cur;
+    const char *what;
     
     if (!heap_start){
-        printf("null heap root\n");
+        printf("line %d: null heap root\n", line);
         return false;
     }else{
         block=heap_start;
     }
 
-    i=0;
     size = get_size(block);
 
     while (size>0){
-        if (!check_block(block)){
-            printf("invalid block\n");
+        if ((what = check_block(block)) != NULL
+                || (!get_alloc(block) && (what = check_links(block)) != NULL)){
+            printf("line %d: %s at block %p\n", line, what, (void *)block);
             return false;
         }
 
@@ -641,17 +3726,37 @@ bool mm_checkheap(int line){
         size = get_size(block);
     }
     
-    while (i<NUM_LIST){
-        block_cur = segregated_list[i];
-        while(block_cur){
-            free_block-=1;
-            block_cur = *(block_t **)((char *)block_cur + wsize);
+    for (i=0;i<FL_COUNT;i++){
+        for (j=0;j<SL_COUNT;j++){
+            block_cur = free_lists[i][j];
+            if (!block_cur != !(sl_bitmap[i] & ((uint32_t)1 << j))){
+                printf("line %d: bitmap out of sync with free list\n", line);
+                return false;
+            }
+            while(block_cur){
+                free_block-=1;
+                block_cur = get_next_free(block_cur);
+            }
         }
-        i+=1;
     }
 
+    free_block -= tree_count(tree_root);
+
     if (free_block){
-        printf("number of free block not matching free list\n");
+        printf("line %d: number of free block not matching free list\n",
+               line);
+        return false;
+    }
+
+    size = 0;
+    for (i=0;i<QUICK_CLASSES;i++){
+        for (block_cur = quick_lists[i]; block_cur;
+             block_cur = *(block_t **)header_to_payload(block_cur)){
+            size += get_size(block_cur);
+        }
+    }
+    if (size != stats.quick_bytes){
+        printf("line %d: quick list bytes not matching the counter\n", line);
         return false;
     }
 
@@ -674,37 +3779,224 @@ static bool is_aligned(void *bp){
 }
 
 /*
- * check_block:check each single block
- * check: address alignment;heap boundary;minimum size;consecutive blocks
+ * check_block:check each single block,return what is wrong or null
+ *
+ * check: payload alignment;heap boundary;minimum size;the next block's
+ * previous-allocated bit;the canary of an allocated block;the footer and
+ * neighbours of a free block (no two consecutive free blocks)
+ * only the block and the start of the next are read,its links are left
+ * to check_links
  */
-static bool check_block(block_t *block){
+static const char *check_block(block_t *block){
 
-    bool valid = false;
     size_t size = get_size(block);
+    block_t *block_next;
+    word_t footer;
 
-    if (!is_aligned(block)){
-        printf("Payload address (%p) not aligned to 16 bytes\n", block);
-
-    }else if(size<min_block_size){
-        printf("Not appropriate block size\n");
+    if (!is_aligned(header_to_payload(block))){
+        return "payload not aligned to 16 bytes";
+    }
+    if (size < min_block_size || size % 16 != 0){
+        return "bad block size";
+    }
+    block_next = find_next(block);
+    if (!check_in_heap(block)
+            || (char *)block_next > (char *)mem_heap_hi() + 1 - wsize){
+        return "block lies outside heap";
+    }
+    if (!read_bit(block_next, 2) != !get_alloc(block)){
+        return "previous-allocated bit of next block is wrong";
+    }
+    if (get_alloc(block)){
+        return canary_ok(block) ? NULL : "canary overwritten";
+    }
 
-    }else if (!check_in_heap(block)){
-        printf("Payload (%p:%p) lies outside heap\n", mem_heap_hi(),mem_heap_lo());
+    footer = *(word_t *)((char *)block + size - wsize);
+    if (extract_size(footer) != size || extract_alloc(footer)){
+        return "footer does not match header";
+    }
+    if (!read_bit(block, 2)){
+        return "two consecutive free blocks";
+    }
+    return NULL;
+}
 
-    }else if (!get_alloc(block)){
-        //no two consecutive free blocks
-        block_t *block_next = find_next(block);
-        block_t *next_free = *(block_t **)((char *)block + wsize);
+/*
+ * check_links:check that the list or tree links of a free block point
+ *             back at it,return what is wrong or null
+ */
+static const char *check_links(block_t *block){
+
+    size_t fl, sl;
+    int i;
+    block_t *block_next, *block_prev;
+    tree_node_t *node;
+
+    if (get_size(block) >= tree_min){
+        node = tree_node(block);
+        if (!link_ok(node->parent) || !link_ok(node->child[0])
+                || !link_ok(node->child[1])){
+            return "tree link points outside heap";
+        }
+        if (node->parent ? tree_node(node->parent)->child[0] != block
+                           && tree_node(node->parent)->child[1] != block
+                         : tree_root != block){
+            return "tree parent does not link back";
+        }
+        for (i = 0; i < 2; i++){
+            if (node->child[i] && tree_node(node->child[i])->parent != block){
+                return "tree child does not link back";
+            }
+        }
+        return NULL;
+    }
 
-        if (block_next!=next_free){
-            valid=false;
-            printf("Two consecutive free blocks\n");
+    block_next = get_next_free(block);
+    block_prev = get_prev_free(block);
+    if (!link_ok(block_next) || !link_ok(block_prev)){
+        return "free list link points outside heap";
+    }
+    if (block_next && get_prev_free(block_next) != block){
+        return "next free block does not link back";
+    }
+    if (block_prev){
+        if (get_next_free(block_prev) != block){
+            return "previous free block does not link back";
         }
     }else{
-        valid=true;
+        mapping_insert(get_size(block), &fl, &sl);
+        if (free_lists[fl][sl] != block){
+            return "free block without previous is not list head";
+        }
+    }
+    return NULL;
+}
+
+/*
+ * link_ok:a link is null or the header of a block inside the heap
+ */
+static bool link_ok(block_t *block){
+
+    return block == NULL
+           || (check_in_heap(block) && is_aligned(header_to_payload(block)));
+}
+
+/*
+ * check_step:hardened mode,check the next CHECK_STEP blocks of the heap
+ *            at the start of call op,wrapping around at the epilogue
+ *
+ * caller holds heap_lock in thread-safe mode
+ */
+static void check_step(const char *op){
+
+    int i;
+    const char *what;
+
+    if (!hardened || heap_start == NULL){
+        return;
+    }
+    check_op = op;
+    for (i = 0; i < CHECK_STEP; i++){
+        if (check_cursor == NULL || get_size(check_cursor) == 0){
+            check_cursor = heap_start;
+        }
+        if ((what = check_block(check_cursor)) != NULL){
+            check_fault(check_cursor, what);
+        }
+        check_cursor = find_next(check_cursor);
+    }
+    // check_block read the header of the cursor block already,fetch its
+    // last word too so the next call does not wait on memory
+    __builtin_prefetch((char *)check_cursor + get_size(check_cursor) - wsize);
+}
+
+/*
+ * check_allocated:hardened mode,fault unless block is an allocated block
+ *                 with its canary intact (a double or stray free)
+ */
+static void check_allocated(block_t *block){
+
+    if (!hardened){
+        return;
+    }
+    // the fourth bit of a mapping marks a sample
+    if (!get_alloc(block) || (read_bit(block, 4) && !read_bit(block, 3))){
+        check_fault(block, "block is not allocated (double free?)");
+    }
+    if (!canary_ok(block)){
+        check_fault(block, "canary overwritten");
+    }
+}
+
+/*
+ * check_quick:hardened mode,fault unless block,just taken from a quick
+ *             list,is a marked allocated block (its link was not written
+ *             over after the free);the mark is cleared
+ */
+static void check_quick(block_t *block){
+
+    if (!hardened){
+        return;
+    }
+    if (!link_ok(block) || !get_alloc(block) || !read_bit(block, 4)){
+        check_fault(block, "quick list link broken");
+    }
+    free_bit(block, 4);
+}
+
+/*
+ * check_absorbed:hardened mode,keep check_step off the old headers
+ *                inside block,which just grew over its neighbours
+ */
+static void check_absorbed(block_t *block){
+
+    if (hardened && check_cursor > block && check_cursor < find_next(block)){
+        check_cursor = block;
+    }
+}
+
+/*
+ * check_fault:report what is wrong with block and the call that found it,
+ *             then abort
+ */
+static void check_fault(block_t *block, const char *what){
+
+    fprintf(stderr, "mm: %s at block %p (payload %p) during %s\n",
+            what, (void *)block, header_to_payload(block), check_op);
+    abort();
+}
+
+/*
+ * canary_value:what the last word of an allocated block holds,
+ *              mixed with its address and size so an overwritten
+ *              header sends the check to the wrong word as well
+ */
+static word_t canary_value(block_t *block){
+
+    return canary_secret ^ (word_t)((uintptr_t)block * 31 + get_size(block));
+}
+
+/*
+ * canary_set:hardened mode,write the canary of an allocated block
+ *            after its header got its final size
+ */
+static void canary_set(block_t *block){
+
+    if (hardened){
+        *(word_t *)((char *)block + get_size(block) - wsize)
+            = canary_value(block);
     }
+}
 
-    return valid;
+/*
+ * canary_ok:the canary of an allocated block is intact,always true
+ *           outside hardened mode
+ */
+static bool canary_ok(block_t *block){
+
+    return !hardened
+           || *(word_t *)((char *)block + get_size(block) - wsize)
+              == canary_value(block);
 }
 
 
@@ -783,12 +4075,13 @@ static size_t get_size(block_t *block)
 
 /*
  * get_payload_size: returns the payload size of a given block, equal to
- *                   the entire block size minus the header and footer sizes.
+ *                   the entire block size minus the header size
+ *                   (and the canary in hardened mode).
  */
-static word_t get_payload_size(block_t *block)
+static size_t get_payload_size(block_t *block)
 {
     size_t asize = get_size(block);
-    return asize - wsize;
+    return asize - wsize - canary_size;
 }
 
 /*
@@ -894,8 +4187,10 @@ static size_t read_bit(block_t *block, int bit){
     switch (bit){
     case 2:
         return ((word_t)(block->header)) & second_bit_mask;
-    default:
+    case 3:
         return ((word_t)(block->header)) & third_bit_mask; 
+    default:
+        return ((word_t)(block->header)) & fourth_bit_mask; 
     }
 }
 
@@ -915,51 +4210,143 @@ static void free_bit(block_t *block,int bit){
     switch (bit){
     case 2:
         block->header = (block->header) & (~second_bit_mask);
-    default:
+        break;
+    case 3:
         block->header = (block->header) & (~third_bit_mask);
+        break;
+    default:
+        block->header = (block->header) & (~fourth_bit_mask);
     }
 }
 
 /*
- * get_block_offset: return the index in the segregated list by size
- *                   require i<NUM_LIST
+ * mapping_insert: return the first/second level class of a block of asize
+ *                 sizes below 2**FL_SHIFT are split linearly in class 0
  */
-static size_t get_block_offset(size_t asize){
+static void mapping_insert(size_t asize, size_t *fl, size_t *sl){
 
-    size_t i;
+    size_t f;
 
-    if(asize<32){
-        i=0;
-    }else if(asize<64){
-        i=1;
-    }else if(asize<128){
-        i=2;
-    }else if(asize<256){
-        i=3;
-    }else if(asize<512){
-        i=4;
-    }else if(asize<1024){
-        i=5;
-    }else if(asize<2048){
-        i=6;
-    }else if(asize<4096){
-        i=7;
-    }else if(asize<9192){
-        i=8;
-    }else if(asize<18384){
-        i=9;
-    }else if(asize<36768){
-        i=10;
-    }else if(asize<73536){
-        i=11;
-    }else if(asize<147072){
-        i=12;
-    }else if(asize<294144){
-        i=13;
-    }else if(asize<588288){
-        i=14;
+    if (asize < ((size_t)1 << FL_SHIFT)){
+        *fl = 0;
+        *sl = asize / (((size_t)1 << FL_SHIFT) / SL_COUNT);
     }else{
-        i=15;
+        f = 63 - __builtin_clzll(asize);
+        *fl = f - FL_SHIFT + 1;
+        *sl = (asize >> (f - SL_LOG2)) - SL_COUNT;
     }
-    return i;
-}
\ No newline at end of file
+}
+
+/*
+ * mapping_search: return the class of the smallest list whose blocks
+ *                 are all at least asize;fl is FL_COUNT if none can be
+ */
+static void mapping_search(size_t asize, size_t *fl, size_t *sl){
+
+    size_t f;
+
+    if (asize >= ((size_t)1 << FL_SHIFT)){
+        f = 63 - __builtin_clzll(asize);
+        if (asize > SIZE_MAX - ((size_t)1 << (f - SL_LOG2))){
+            *fl = FL_COUNT;
+            return;
+        }
+        asize += ((size_t)1 << (f - SL_LOG2)) - 1;
+    }
+    mapping_insert(asize, fl, sl);
+}
+
+/*
+ * get_next_free: returns the next block in the free list of a free block
+ */
+static block_t *get_next_free(block_t *block)
+{
+    return link_to_block(((link_t *)block->payload)[0]);
+}
+
+/*
+ * get_prev_free: returns the previous block in the free list of a free block
+ */
+static block_t *get_prev_free(block_t *block)
+{
+    return link_to_block(((link_t *)block->payload)[1]);
+}
+
+/*
+ * set_next_free: sets the next pointer of a free block
+ */
+static void set_next_free(block_t *block, block_t *next)
+{
+    ((link_t *)block->payload)[0] = block_to_link(next);
+}
+
+/*
+ * set_prev_free: sets the previous pointer of a free block
+ */
+static void set_prev_free(block_t *block, block_t *prev)
+{
+    ((link_t *)block->payload)[1] = block_to_link(prev);
+}
+
+/*
+ * link_to_block: the block a stored link refers to,null for none
+ */
+static block_t *link_to_block(link_t link)
+{
+#ifdef MM_COMPACT
+    if (link == link_null){
+        return NULL;
+    }
+    return (block_t *)((char *)heap_start + link);
+#else
+    return link;
+#endif
+}
+
+/*
+ * block_to_link: the link to store for block,which may be null
+ */
+static link_t block_to_link(block_t *block)
+{
+#ifdef MM_COMPACT
+    if (block == NULL){
+        return link_null;
+    }
+    return (link_t)((char *)block - (char *)heap_start);
+#else
+    return block;
+#endif
+}
+
+/*
+ * link_size: payload bytes a free block of size bytes uses for its links,
+ *            next/prev in a list or a tree node
+ */
+static size_t link_size(size_t size)
+{
+    return size >= tree_min ? sizeof(tree_node_t) : 2*sizeof(link_t);
+}
+
+/*
+ * tree_node: the tree links in the payload of a free block
+ */
+static tree_node_t *tree_node(block_t *block)
+{
+    return (tree_node_t *)(block->payload);
+}
+
+/*
+ * tree_less: order of the size tree,by size and then by address
+ */
+static bool tree_less(block_t *a, block_t *b)
+{
+    return get_size(a) < get_size(b) || (get_size(a) == get_size(b) && a < b);
+}
+
+/*
+ * tree_red: colour of a tree node,null leaves count as black
+ */
+static bool tree_red(block_t *block)
+{
+    return block && tree_node(block)->red;
+}
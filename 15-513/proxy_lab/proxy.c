@@ -6,16 +6,28 @@
  *          and deal with multiple concurrent connections.
  *			note: web cache is not completed
  * 			request headers are declared as const for convenience
+ *          upstream connections race all resolved addresses
+ *          (happy eyeballs, RFC 8305) instead of connecting in order
  * reference:tiny.c
  **********************************************************************/
 
 #include "csapp.h"
 #include <stdio.h>
+#include <poll.h>
+#include <time.h>
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Happy eyeballs: delay between connection attempts and overall limit */
+#define CONNECT_STAGGER_MS 250
+#define CONNECT_TIMEOUT_MS 10000
+#define MAX_ATTEMPTS 16
+
+/* number of origins whose preferred address family is remembered */
+#define PREF_CACHE_SIZE 64
+
 /* function prototype */
 void *thread(void *vargp);
 void proxy(int connfd);
@@ -23,6 +35,10 @@ void send_request(int serverfd,char* host, char* request, char* buf);
 void clienterror(int fd, char *cause, char *errnum, 
 	             char *shortmsg, char *longmsg);
 void parse_url(char *url, char *host, char* port,char* request);
+int open_clientfd_race(char *host, char *port);
+static int get_family_pref(char *host, char *port);
+static void set_family_pref(char *host, char *port, int family);
+static long now_ms(void);
 
 /* request headers declaration */
 static char* header_user_agent = "Mozilla/5.0"
@@ -31,6 +47,17 @@ static char* header_user_agent = "Mozilla/5.0"
 static char* connection_header = "Connection: close\r\n";
 static char* proxy_conn_header = "Proxy-Connection:close\r\n";
 
+/* address family that last won the race for an origin (host:port) */
+typedef struct {
+    char host[MAXLINE/32];
+    char port[16];
+    int family;
+} family_pref;
+
+static family_pref pref_cache[PREF_CACHE_SIZE];
+static int pref_next;          /* next slot to replace, round robin */
+static sem_t pref_mutex;       /* protects pref_cache and pref_next */
+
 /* 
  * main: initialize and open a new connection (connfdp)
  *		 use concurrent programming with threads
@@ -51,6 +78,7 @@ int main(int argc, char **argv){
     }
 
     Signal(SIGPIPE, SIG_IGN);
+    Sem_init(&pref_mutex, 0, 1);
     listenfd=Open_listenfd(argv[1]);
 
     while (1){
@@ -120,7 +148,7 @@ void proxy(int connfd){
 
 	parse_url(url, host, port, request);
 
-    if ((serverfd=Open_clientfd(host, port))<0){
+    if ((serverfd=open_clientfd_race(host, port))<0){
     	clienterror(connfd, url, "505", "Not Supported",
           			"Not correct http protocol");
         Close(connfd);
@@ -245,3 +273,219 @@ void send_request(int serverfd,char* host, char* request, char* buf){
 	return;
 }
 
+/* 
+ * open_clientfd_race: open a connection to host:port, happy eyeballs style
+ *                     return a connected (blocking) fd, or -1 on failure
+ *
+ * addresses are interleaved by family, starting with the family that won
+ * last time for this origin (IPv6 if unknown); attempts are non-blocking
+ * and a new one starts every CONNECT_STAGGER_MS, or at once when an
+ * attempt fails. the first connect to complete wins and the rest are closed,
+ * so a blackholed address costs at most one stagger instead of a timeout
+ * reference: RFC 8305 and open_clientfd in csapp.c
+ */
+int open_clientfd_race(char *host, char *port){
+
+    struct addrinfo hints, *listp, *p;
+    struct addrinfo *addrs[MAX_ATTEMPTS];
+    struct addrinfo *v6[MAX_ATTEMPTS], *v4[MAX_ATTEMPTS];
+    struct addrinfo **first, **second;
+    struct pollfd pfds[MAX_ATTEMPTS];
+    int idx[MAX_ATTEMPTS];          /* pfds[i] belongs to addrs[idx[i]] */
+    int n = 0, n6 = 0, n4 = 0, nfirst, nsecond;
+    int next = 0, active = 0;
+    int i, j, rc, err, flags;
+    int winner = -1, win_family = AF_UNSPEC;
+    long now, next_start, deadline, wait;
+    socklen_t errlen;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(host, port, &hints, &listp)) != 0){
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n",
+                host, port, gai_strerror(rc));
+        return -1;
+    }
+
+    //split by family, then interleave them with the preferred family first
+    for (p = listp; p; p = p->ai_next){
+        if (p->ai_family == AF_INET6 && n6 < MAX_ATTEMPTS){
+            v6[n6++] = p;
+        }else if (p->ai_family != AF_INET6 && n4 < MAX_ATTEMPTS){
+            v4[n4++] = p;
+        }
+    }
+    if (get_family_pref(host, port) == AF_INET){
+        first = v4; nfirst = n4;
+        second = v6; nsecond = n6;
+    }else{
+        first = v6; nfirst = n6;
+        second = v4; nsecond = n4;
+    }
+    for (i = 0, j = 0; n < MAX_ATTEMPTS && (i < nfirst || j < nsecond);){
+        if (i < nfirst){
+            addrs[n++] = first[i++];
+        }
+        if (j < nsecond && n < MAX_ATTEMPTS){
+            addrs[n++] = second[j++];
+        }
+    }
+
+    now = now_ms();
+    deadline = now + CONNECT_TIMEOUT_MS;
+    next_start = now;
+
+    while (winner < 0 && now < deadline){
+
+        //start the next attempt when the stagger expired or nothing is left
+        if (next < n && (active == 0 || now >= next_start)){
+            p = addrs[next++];
+            next_start = now + CONNECT_STAGGER_MS;
+            if ((pfds[active].fd = socket(p->ai_family,
+                    p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0){
+                next_start = now;
+                continue;
+            }
+            if (connect(pfds[active].fd, p->ai_addr, p->ai_addrlen) == 0){
+                winner = pfds[active].fd;
+                win_family = p->ai_family;
+                break;
+            }
+            if (errno != EINPROGRESS){
+                close(pfds[active].fd);
+                next_start = now;
+                continue;
+            }
+            pfds[active].events = POLLOUT;
+            idx[active++] = next - 1;
+        }
+
+        if (active == 0){
+            if (next >= n){
+                break;
+            }
+            continue;
+        }
+
+        wait = deadline - now;
+        if (next < n && next_start - now < wait){
+            wait = next_start - now;
+        }
+        if (wait < 0){
+            wait = 0;
+        }
+        if (poll(pfds, active, (int)wait) < 0 && errno != EINTR){
+            break;
+        }
+
+        for (i = 0; i < active && winner < 0; i++){
+            if (!pfds[i].revents){
+                continue;
+            }
+            errlen = sizeof(err);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0){
+                err = errno;
+            }
+            if (!err){
+                winner = pfds[i].fd;
+                win_family = addrs[idx[i]]->ai_family;
+                pfds[i].fd = -1;
+                break;
+            }
+            //failed attempt: drop it and let the next one start at once
+            close(pfds[i].fd);
+            for (j = i; j < active - 1; j++){
+                pfds[j] = pfds[j+1];
+                idx[j] = idx[j+1];
+            }
+            active--;
+            i--;
+            next_start = 0;
+        }
+        now = now_ms();
+    }
+
+    for (i = 0; i < active; i++){
+        if (pfds[i].fd >= 0 && pfds[i].fd != winner){
+            close(pfds[i].fd);
+        }
+    }
+    freeaddrinfo(listp);
+
+    if (winner < 0){
+        return -1;
+    }
+
+    //the rest of the proxy uses blocking rio calls
+    flags = fcntl(winner, F_GETFL, 0);
+    fcntl(winner, F_SETFL, flags & ~O_NONBLOCK);
+    set_family_pref(host, port, win_family);
+    return winner;
+}
+
+/* 
+ * get_family_pref: return the family that last won for host:port
+ *                  AF_INET6 if the origin has not been seen
+ */
+static int get_family_pref(char *host, char *port){
+
+    int i;
+    int family = AF_INET6;
+
+    P(&pref_mutex);
+    for (i = 0; i < PREF_CACHE_SIZE; i++){
+        if (pref_cache[i].family != AF_UNSPEC
+                && !strcmp(pref_cache[i].host, host)
+                && !strcmp(pref_cache[i].port, port)){
+            family = pref_cache[i].family;
+            break;
+        }
+    }
+    V(&pref_mutex);
+    return family;
+}
+
+/* 
+ * set_family_pref: remember the winning family of host:port
+ *                  update the entry in place, else replace round robin
+ */
+static void set_family_pref(char *host, char *port, int family){
+
+    int i;
+    family_pref *entry = NULL;
+
+    if (strlen(host) >= sizeof(entry->host)
+            || strlen(port) >= sizeof(entry->port)){
+        return;
+    }
+
+    P(&pref_mutex);
+    for (i = 0; i < PREF_CACHE_SIZE; i++){
+        if (pref_cache[i].family != AF_UNSPEC
+                && !strcmp(pref_cache[i].host, host)
+                && !strcmp(pref_cache[i].port, port)){
+            entry = &pref_cache[i];
+            break;
+        }
+    }
+    if (!entry){
+        entry = &pref_cache[pref_next];
+        pref_next = (pref_next + 1) % PREF_CACHE_SIZE;
+        strcpy(entry->host, host);
+        strcpy(entry->port, port);
+    }
+    entry->family = family;
+    V(&pref_mutex);
+}
+
+/* 
+ * now_ms: monotonic clock in milliseconds
+ */
+static long now_ms(void){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+#
+# race-test.py: check the proxy's happy eyeballs connect (open_clientfd_race)
+#
+# the origin listens on ::1 and 127.0.0.1 under one port, one family
+# serving and the other blackholed: a listener that never accepts, its
+# accept queue filled up, so the kernel drops further SYNs and a connect
+# neither succeeds nor fails.
+#
+#   1. ::1 blackholed:the first request waits one stagger for IPv4 to
+#      win,the second starts with IPv4 and is served at once
+#   2. the families swap:IPv4 now blackholes,IPv6 wins after a stagger,
+#      and the preference follows it for the request after that
+#
+# host must resolve to both ::1 and 127.0.0.1 (with AI_ADDRCONFIG),
+# otherwise the test is skipped
+#
+#   usage: ./race-test.py [proxy] [host]
+#
+
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+STAGGER = 0.250         # CONNECT_STAGGER_MS in proxy.c
+SLACK = 0.200           # scheduling allowance on each side
+FAMILIES = {socket.AF_INET6: '::1', socket.AF_INET: '127.0.0.1'}
+
+
+def free_port():
+    with socket.socket(socket.AF_INET6, socket.SOCK_STREAM) as s:
+        s.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_V6ONLY, 0)
+        s.bind(('::', 0))
+        return s.getsockname()[1]
+
+
+def listener(family, port, backlog):
+    s = socket.socket(family, socket.SOCK_STREAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    if family == socket.AF_INET6:
+        s.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_V6ONLY, 1)
+    s.bind((FAMILIES[family], port))
+    s.listen(backlog)
+    return s
+
+
+class Origin:
+    """answer every request on one family with 'ok' until closed"""
+
+    def __init__(self, family, port):
+        self.sock = listener(family, port, 16)
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def run(self):
+        while True:
+            try:
+                conn, _ = self.sock.accept()
+            except OSError:
+                return
+            with conn:
+                data = b''
+                while b'\r\n\r\n' not in data:
+                    chunk = conn.recv(4096)
+                    if not chunk:
+                        break
+                    data += chunk
+                conn.sendall(b'HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok')
+
+    def close(self):
+        # wakes the accept,a bare close leaves the port bound until it returns
+        self.sock.shutdown(socket.SHUT_RDWR)
+        self.thread.join()
+        self.sock.close()
+
+
+class Blackhole:
+    """a listener that never accepts,with its accept queue full"""
+
+    def __init__(self, family, port):
+        self.sock = listener(family, port, 0)
+        self.fillers = []
+        while len(self.fillers) < 64:
+            c = socket.socket(family, socket.SOCK_STREAM)
+            c.settimeout(0.2)
+            try:
+                c.connect((FAMILIES[family], port))
+            except (socket.timeout, OSError):
+                c.close()
+                return
+            self.fillers.append(c)
+        sys.exit('FAIL: cannot fill the accept queue on %s' % FAMILIES[family])
+
+    def close(self):
+        for c in self.fillers:
+            c.close()
+        self.sock.close()
+
+
+def request(proxy_port, host, port, path):
+    start = time.monotonic()
+    with socket.create_connection(('127.0.0.1', proxy_port), timeout=15) as s:
+        s.sendall(('GET http://%s:%d%s HTTP/1.0\r\n\r\n'
+                   % (host, port, path)).encode())
+        data = b''
+        while True:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+    return time.monotonic() - start, data
+
+
+def check(what, ok):
+    print('%s %s' % ('ok  ' if ok else 'FAIL', what))
+    return ok
+
+
+def main():
+    proxy = sys.argv[1] if len(sys.argv) > 1 else './proxy'
+    host = sys.argv[2] if len(sys.argv) > 2 else 'localhost'
+
+    found = {a[0] for a in socket.getaddrinfo(host, 80, 0, socket.SOCK_STREAM,
+                                              0, socket.AI_ADDRCONFIG)}
+    if not all(f in found for f in FAMILIES):
+        print('SKIP: %s does not resolve to both ::1 and 127.0.0.1'
+              ' (e.g. add "::1 %s" to /etc/hosts)' % (host, host))
+        return 0
+
+    port = free_port()
+    proxy_port = free_port()
+    proc = subprocess.Popen([proxy, str(proxy_port)],
+                            stdout=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            try:
+                socket.create_connection(('127.0.0.1', proxy_port), 1).close()
+                break
+            except OSError:
+                time.sleep(0.05)
+        else:
+            sys.exit('FAIL: proxy did not start on port %d' % proxy_port)
+
+        good = True
+        n = 0
+        for slow, fast in ((socket.AF_INET6, socket.AF_INET),
+                           (socket.AF_INET, socket.AF_INET6)):
+            hole = Blackhole(slow, port)
+            origin = Origin(fast, port)
+            name = FAMILIES[fast]
+            for first in (True, False):
+                n += 1
+                elapsed, data = request(proxy_port, host, port, '/%d' % n)
+                good &= check('request %d served over %s' % (n, name),
+                              data.endswith(b'ok'))
+                if first:
+                    good &= check('request %d: %s won after one stagger'
+                                  ' (%.0f ms)' % (n, name, elapsed * 1000),
+                                  STAGGER - SLACK / 4 <= elapsed
+                                  < STAGGER + SLACK)
+                else:
+                    good &= check('request %d: %s tried first (%.0f ms)'
+                                  % (n, name, elapsed * 1000),
+                                  elapsed < STAGGER - SLACK / 4)
+            hole.close()
+            origin.close()
+    finally:
+        proc.kill()
+        proc.wait()
+    print('all checks passed' if good else 'some checks failed')
+    return 0 if good else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())